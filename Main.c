@@ -38,7 +38,23 @@
 #include <time.h>
 #include <math.h>
 
-#include <immintrin.h> 
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#else
+    #include <cpuid.h>
+#endif
+
+#ifdef _OPENMP
+    #include <omp.h>
+#else
+    // single threaded fallback when built without openmp
+    #define omp_get_max_threads()   1
+    #define omp_get_num_threads()   1
+    #define omp_get_thread_num()    0
+    #define omp_set_dynamic(x)      ((void)(x))
+#endif
 
 #include "./include/util.h"
 #include "./include/font.h"
@@ -48,6 +64,30 @@
 
 #define NUM_SIZES                   16
 
+#define TILE_SIZE_LOG2              6
+#define TILE_SIZE                   (1 << TILE_SIZE_LOG2)
+#define MAX_RASTER_THREADS          64
+
+#define HIZ_BLOCK_SIZE_LOG2         3
+#define HIZ_BLOCK_SIZE              (1 << HIZ_BLOCK_SIZE_LOG2)
+
+#define SUBPIXEL_BITS               4
+#define SUBPIXEL_ONE                (1 << SUBPIXEL_BITS)
+#define GUARD_BAND                  2048.f      // pixels away from the viewport center
+#define CLIP_W_EPSILON              1e-6f
+#define MAX_CLIP_VERTICES           (3 + CLIP_PLANE_COUNT)
+#define MAX_CLIP_LERPS              (2 * CLIP_PLANE_COUNT)  // vertices clipping can create, two per plane
+#define VERTEX_BATCH                64          // vertices transformed per call, a multiple of 16
+#define MAX_VARYINGS                8           // floats a vertex shader can pass to the fragment shader
+#define SMALL_TRI_SIZE              2           // bounding boxes up to this many pixels a side take the small path
+#define MESHLET_MAX_VERTICES        64
+#define MESHLET_MAX_TRIANGLES       124
+#define VISIBILITY_TRIANGLE_BITS    20          // low bits of a visibility id, a triangle within one record
+#define VISIBILITY_MAX_RECORDS      ((1u << (32 - VISIBILITY_TRIANGLE_BITS)) - 1)   // the last is unused so no id is VISIBILITY_EMPTY
+#define VISIBILITY_EMPTY            0xFFFFFFFFu
+#define MAX_TEXTURE_LEVELS          16          // levels of a texture of up to 32768 texels a side
+#define TEXTURE_CACHE_SIZE          256         // decoded 4x4 blocks a thread keeps, a power of two
+
 #define RGBA_TO_UINT32(r, g, b, a)  ((unsigned)(r) | ((unsigned)(g) << 8) | ((unsigned)(b) << 16) | ((unsigned)(a) << 24))
 #define COLOR_BUF_AT(C,x,y)         (C)->pixels[(x)+(y)*C->width]
 
@@ -57,6 +97,9 @@
 typedef uint8_t  u8;
 typedef int8_t   s8;
 
+typedef uint16_t u16;
+typedef int16_t  i16;
+
 typedef uint32_t u32;
 typedef int32_t  i32;
 
@@ -94,6 +137,13 @@ typedef struct vec4f_t
     f32 w;    
 }vec4f_t;
 
+typedef struct vec3i16_t
+{
+    i16 x;
+    i16 y;
+    i16 z;
+}vec3i16_t;
+
 typedef struct vertex_t
 {
     vec4f_t pos;
@@ -101,15 +151,40 @@ typedef struct vertex_t
 }vertex_t;
 
 
-#define ATTR_AT(a,i)   ((char const *)((a).ptr) + (a).stride * (i))
+#define ATTR_AT(a,i)   ((char const *)((a).ptr) + (size_t)(a).stride * (i))
 #define ATTR_NEW(p)    (attribute_t) {.ptr = (p), .stride = sizeof(typeof((p)[0]))}
 
+/*
+    Storage of the components of an attribute. Normalized formats are read as
+    fractions of their largest value, quantized positions are mapped back to
+    object space by the quantization of the mesh
+*/
+typedef enum attribute_format_t
+{
+    ATTRIBUTE_FORMAT_NATIVE,            // the type of the attribute, vec3f_t positions and color4_t colors
+    ATTRIBUTE_FORMAT_F32,               // 32 bit floats
+    ATTRIBUTE_FORMAT_F16,               // 16 bit floats
+    ATTRIBUTE_FORMAT_SNORM16,           // [-1,1] in 16 bit signed integers
+    ATTRIBUTE_FORMAT_UNORM8,            // [0,1] in 8 bit unsigned integers, always read 4 bytes at a time
+    ATTRIBUTE_FORMAT_UNORM10_10_10_2,   // [0,1] in a u32, 10 bits for each of the first three components and 2 for the fourth
+}attribute_format_t;
+
 typedef struct attribute_t
 {
     void const *ptr;
     u32 stride;             // distance in bytes between two values
+    attribute_format_t format;
 }attribute_t;   
 
+/*
+    Values a quantized attribute stands for, offset + scale * normalized value
+*/
+typedef struct quantization_t
+{
+    vec3f_t     scale;
+    vec3f_t     offset;
+}quantization_t;
+
 typedef struct image_view_t
 {
     color4_t    *pixels;
@@ -117,23 +192,217 @@ typedef struct image_view_t
     u32         height;
 }image_view_t;
 
+typedef enum filter_t
+{
+    FILTER_NEAREST,         // nearest texel of the nearest level
+    FILTER_BILINEAR,        // 2x2 texels of the nearest level
+    FILTER_TRILINEAR        // 2x2 texels of the two nearest levels, blended
+}filter_t;
+
+typedef enum wrap_t
+{
+    WRAP_REPEAT,
+    WRAP_CLAMP
+}wrap_t;
+
+typedef struct sampler_t
+{
+    filter_t    filter;
+    wrap_t      wrap;
+}sampler_t;
+
+typedef enum texture_format_t
+{
+    TEXTURE_FORMAT_RGBA8,
+    TEXTURE_FORMAT_BC1,         // 8 bytes a 4x4 block, opaque colors
+    TEXTURE_FORMAT_BC3,         // 16 bytes a block, BC1 colors and interpolated alpha
+    TEXTURE_FORMAT_BC7          // 16 bytes a block, RGBA in one of eight modes
+}texture_format_t;
+
+/*
+    Texels of a level are in Morton order, the 2x2 footprint of a sample is
+    close together whatever the orientation of the triangle. Compressed
+    levels put their 4x4 blocks in Morton order instead
+*/
+typedef struct texture_level_t
+{
+    color4_t    *texels;        // RGBA8
+    u8          *blocks;        // block compressed formats
+    u32         width_log2;
+    u32         height_log2;
+}texture_level_t;
+
+typedef struct texture_t
+{
+    texture_format_t format;
+    void            *data;          // every level, largest first
+    u32             width;          // of the first level, powers of two
+    u32             height;
+    u32             level_count;
+    texture_level_t levels[MAX_TEXTURE_LEVELS];
+}texture_t;
+
+/*
+    Decoded blocks of compressed textures, direct mapped by block address.
+    Each raster thread has its own
+*/
+typedef struct texture_cache_t
+{
+    u8 const    *tags[TEXTURE_CACHE_SIZE];
+    color4_t    texels[TEXTURE_CACHE_SIZE][16];
+}texture_cache_t;
+
+typedef enum depth_format_t
+{
+    DEPTH_FORMAT_D16,       // 16 bit unorm
+    DEPTH_FORMAT_D24,       // 24 bit unorm in the low bits of a u32
+    DEPTH_FORMAT_D32F,      // 32 bit float
+}depth_format_t;
+
+/*
+    Depth range of a screen region, quantized the same way as the depth buffer
+    so the values order like the stored depth
+*/
+typedef struct depth_bounds_t
+{
+    i32             min;
+    i32             max;
+}depth_bounds_t;
+
+/*
+    Conservative depth bounds of every 8x8 block and every tile, blocks are
+    exact after each triangle, tiles are widened while a tile is rasterized
+    and tightened from their blocks once its bin is done
+*/
+typedef struct hiz_t
+{
+    depth_bounds_t  *blocks;
+    depth_bounds_t  *tiles;
+    u32             blocks_x;
+    u32             blocks_y;
+    u32             tiles_x;
+    u32             tiles_y;
+}hiz_t;
+
+typedef struct depth_view_t
+{
+    void            *pixels;
+    u32             width;
+    u32             height;
+    depth_format_t  format;
+    bool            reverse_z;      // near is 1 and far is 0, clears to 0
+    hiz_t           *hiz;           // optional
+}depth_view_t;
+
+typedef struct stencil_view_t
+{
+    u8              *pixels;
+    u32             width;
+    u32             height;
+}stencil_view_t;
+
+typedef struct visibility_t visibility_t;
+typedef struct oit_t        oit_t;
+typedef struct shader_t     shader_t;
+
+typedef struct framebuffer_t
+{
+    image_view_t const  *color;
+    depth_view_t const  *depth;     // optional
+    stencil_view_t const *stencil;  // optional
+    visibility_t        *visibility;    // optional, draws only record which triangle covers each pixel until visibility_resolve shades them
+    oit_t               *oit;           // optional, BLEND_WEIGHTED_OIT draws blend over without it
+}framebuffer_t;
+
+/*
+    Cluster of up to MESHLET_MAX_VERTICES vertices and MESHLET_MAX_TRIANGLES
+    triangles that can be culled as a whole before any of its vertices is
+    transformed
+*/
+typedef struct meshlet_t
+{
+    u32         vertex_offset;      // into the meshlet vertex list
+    u32         triangle_offset;    // into the meshlet triangle list, 3 local indices per triangle
+    u32         vertex_count;
+    u32         triangle_count;
+    vec3f_t     center;             // bounding sphere
+    f32         radius;
+    vec3f_t     cone_apex;          // all triangles face away from any eye inside the cone
+    vec3f_t     cone_axis;
+    f32         cone_cutoff;        // sine of the cone half angle, above 1 never culls
+}meshlet_t;
+
+/*
+    Object space bounds of a mesh, a box and a sphere around it
+*/
+typedef struct bounds_t
+{
+    vec3f_t     min;
+    vec3f_t     max;
+    vec3f_t     center;
+    f32         radius;
+}bounds_t;
+
+typedef enum index_format_t
+{
+    INDEX_FORMAT_U32,
+    INDEX_FORMAT_U16,       // up to 65536 vertices
+    INDEX_FORMAT_U8,        // up to 256 vertices
+}index_format_t;
+
+typedef enum topology_t
+{
+    TOPOLOGY_TRIANGLE_LIST,     // 3 vertices per triangle
+    TOPOLOGY_TRIANGLE_STRIP,    // each vertex after the second adds a triangle with the previous two
+    TOPOLOGY_TRIANGLE_FAN       // each vertex after the second adds a triangle with the previous one and the first
+}topology_t;
+
 typedef struct mesh_t
 {
     attribute_t     positions;
     attribute_t     colors;
-    u32 const       *indices;
-    u32             count;
+    void const      *indices;       // optional, index_format wide
+    index_format_t  index_format;
+    topology_t      topology;
+    u32             count;          // indices, or vertices when not indexed
+    u32             vertex_count;   // vertices the indices refer to, required when indexed
+    bounds_t const  *bounds;        // optional, lets the whole draw be culled
+    quantization_t const *position_quantization;    // optional, object space of normalized positions
+
+    meshlet_t const *meshlets;              // optional, replaces the indices when present
+    u32 const       *meshlet_vertices;      // mesh vertex of each meshlet vertex
+    u8 const        *meshlet_triangles;     // meshlet vertex of each triangle corner
+    u32             meshlet_count;
+    u32             meshlet_vertex_count;
 }mesh_t;
 
 typedef struct model_t
 {
     vec3f_t     *positions;
+    vec3i16_t   *quantized_positions;       // snorm16 copy of the positions read by draws
+    quantization_t quantization;
     color4_t    *colors;
     u32         *indices;
     u32         vertex_count;
     u32         index_count;
+    bounds_t    bounds;
+    meshlet_t   *meshlets;
+    u32         *meshlet_vertices;
+    u8          *meshlet_triangles;
+    u32         meshlet_count;
+    u32         meshlet_vertex_count;
+    u32         meshlet_triangle_count;
 }model_t;
 
+/*
+    Planes with normals pointing inside, normalized so the distance to a point
+    is dot(xyz, p) + w
+*/
+typedef struct frustum_t
+{
+    vec4f_t     planes[6];
+}frustum_t;
+
 typedef enum cull_mode_t
 {
     CULL_MODE_NONE,
@@ -141,6 +410,91 @@ typedef enum cull_mode_t
     CULL_MODE_CCW    // counter-clockwise
 }cull_mode_t;
  
+typedef enum compare_op_t
+{
+    COMPARE_NEVER,
+    COMPARE_LESS,
+    COMPARE_EQUAL,
+    COMPARE_LESS_EQUAL,
+    COMPARE_GREATER,
+    COMPARE_NOT_EQUAL,
+    COMPARE_GREATER_EQUAL,
+    COMPARE_ALWAYS
+}compare_op_t;
+
+typedef struct depth_state_t
+{
+    bool            test;
+    bool            write;          // only lanes that pass the test are written
+    compare_op_t    compare;        // incoming depth against the stored one
+}depth_state_t;
+
+typedef enum stencil_op_t
+{
+    STENCIL_OP_KEEP,
+    STENCIL_OP_ZERO,
+    STENCIL_OP_REPLACE,             // with the reference
+    STENCIL_OP_INCREMENT_CLAMP,
+    STENCIL_OP_DECREMENT_CLAMP,
+    STENCIL_OP_INVERT,
+    STENCIL_OP_INCREMENT_WRAP,
+    STENCIL_OP_DECREMENT_WRAP
+}stencil_op_t;
+
+/*
+    The stencil test runs before the depth test, a fragment that fails it
+    is dropped. Every covered pixel then gets the op of its outcome
+*/
+typedef struct stencil_state_t
+{
+    bool            test;
+    compare_op_t    compare;        // reference against the stored value, both through read_mask
+    u8              reference;
+    u8              read_mask;
+    u8              write_mask;     // bits the ops can change
+    stencil_op_t    fail;           // failed the stencil test
+    stencil_op_t    depth_fail;     // passed it but failed the depth test
+    stencil_op_t    pass;           // passed both
+}stencil_state_t;
+
+typedef enum interpolation_t
+{
+    INTERPOLATION_PERSPECTIVE,      // attributes divided by w at every pixel
+    INTERPOLATION_FLAT              // first vertex of the triangle everywhere
+}interpolation_t;
+
+typedef enum attribute_bits_t
+{
+    ATTRIBUTE_COLOR = 1 << 0
+}attribute_bits_t;
+
+/*
+    How the fragment color combines with the pixel under it, a is the
+    fragment alpha
+*/
+typedef enum blend_mode_t
+{
+    BLEND_NONE,                     // replaces the pixel
+    BLEND_OVER,                     // src * a + dst * (1 - a)
+    BLEND_ADDITIVE,                 // src * a + dst
+    BLEND_PREMULTIPLIED,            // src + dst * (1 - a), the color is already multiplied by alpha
+    BLEND_WEIGHTED_OIT              // accumulated into the oit buffers in any order, oit_resolve composites them
+}blend_mode_t;
+
+/*
+    Fixed function state of a draw, resolved to one of the specialized raster
+    kernels when the draw is executed
+*/
+typedef struct pipeline_state_t
+{
+    cull_mode_t     cull_mode;
+    depth_state_t   depth;
+    stencil_state_t stencil;        // ignored without a stencil buffer
+    interpolation_t interpolation;
+    u32             attributes;     // ATTRIBUTE_* read from the mesh, white without color
+    blend_mode_t    blend;          // anything but BLEND_NONE is drawn through the shaded path
+}pipeline_state_t;
+ 
 typedef struct mat4x4_t
 {
     f32 values[16];
@@ -148,11 +502,28 @@ typedef struct mat4x4_t
 
 typedef struct draw_command_t
 {
-    mesh_t          mesh;
-    cull_mode_t     cull_mode;
-    mat4x4_t        transform;
+    mesh_t              mesh;
+    pipeline_state_t    pipeline;
+    mat4x4_t            transform;
+    u32                 instance_count;         // 0 draws the mesh once
+    attribute_t         instance_transforms;    // mat4x4_t per instance, applied before transform
+    attribute_t         instance_colors;        // optional, color4_t per instance modulating the vertex colors
+    shader_t const      *shader;                // optional, replaces the vertex color shading
+    void const          *uniforms;              // passed to the shader
 }draw_command_t;
 
+/*
+    Draws of a frame, executed in the order of their sort keys
+*/
+typedef struct command_buffer_t
+{
+    draw_command_t  *commands;
+    u64             *keys;          // sort key, index of the command in the low bits
+    u64             *scratch;       // radix sort ping-pong buffer
+    u32             count;
+    u32             capacity;
+}command_buffer_t;
+
 typedef struct viewport_t 
 {
     i32 xmin;
@@ -161,10 +532,273 @@ typedef struct viewport_t
     i32 ymax;
 }viewport_t;
 
+typedef struct cpu_features_t
+{
+    bool        sse41;
+    bool        avx2;
+    bool        fma;
+    bool        avx512f;
+}cpu_features_t;
+
+/*
+    Planes a triangle is clipped against in homogeneous space, the guard band
+    planes only matter for triangles that reach far outside the viewport
+*/
+typedef enum clip_plane_t
+{
+    CLIP_PLANE_W,           // w >= epsilon, nothing behind the eye
+    CLIP_PLANE_NEAR,        // z >= 0
+    CLIP_PLANE_FAR,         // z <= w
+    CLIP_PLANE_LEFT,        // x >= -guard * w
+    CLIP_PLANE_RIGHT,       // x <=  guard * w
+    CLIP_PLANE_TOP,         // y <=  guard * w
+    CLIP_PLANE_BOTTOM,      // y >= -guard * w
+    CLIP_PLANE_COUNT,
+}clip_plane_t;
+
+/*
+    Value of an attribute that is affine in screen space, origin is at the
+    center of the first pixel of the bounding box and steps are per pixel
+*/
+typedef struct plane_t
+{
+    f32         origin;
+    f32         dx;
+    f32         dy;
+}plane_t;
+
+typedef struct clip_vertex_t
+{
+    vec4f_t     position;   // clip space
+    color4_t    color;
+    f32 const   *varyings;  // programmable draws only, varying_count values held out of line
+}clip_vertex_t;
+
+/*
+    Clip space positions of a run of vertices as structure of arrays
+*/
+typedef struct vertex_batch_t
+{
+    f32         x[VERTEX_BATCH];
+    f32         y[VERTEX_BATCH];
+    f32         z[VERTEX_BATCH];
+    f32         w[VERTEX_BATCH];
+}vertex_batch_t;
+
+/*
+    Input of a vertex shader, a batch of fetched vertices as structure of arrays
+*/
+typedef struct shader_vertices_t
+{
+    vertex_batch_t  position;               // object space, w is 1
+    color4_t        color[VERTEX_BATCH];    // white when the pipeline reads no colors, instance color applied
+    u32             index[VERTEX_BATCH];    // mesh vertex, for attributes the shader fetches itself
+    u32             count;
+    mat4x4_t const  *transform;             // object to clip space of the instance
+}shader_vertices_t;
+
+/*
+    Output of a vertex shader, only the first varying_count varyings are read
+*/
+typedef struct shader_varyings_t
+{
+    vertex_batch_t  position;               // clip space
+    f32             varyings[MAX_VARYINGS][VERTEX_BATCH];
+}shader_varyings_t;
+
+/*
+    Input of a fragment shader, a 2x2 quad of pixels with lane i at
+    (x + (i & 1), y + (i >> 1)). Lanes outside mask are helpers, still
+    interpolated so quad_ddx and quad_ddy work on any varying
+*/
+typedef struct shader_quad_t
+{
+    f32         varyings[MAX_VARYINGS][4];  // perspective correct
+    i32         x;
+    i32         y;
+    u32         mask;                       // bit per lane covered and passing the depth test
+}shader_quad_t;
+
+/*
+    Programmable stages of a draw, uniforms is passed back to both as is
+*/
+typedef void (*vertex_shader_fn_t)(void const *uniforms, shader_vertices_t const *in, shader_varyings_t *out);
+
+// r, g, b, a of each lane, 0 to 1
+typedef void (*fragment_shader_fn_t)(void const *uniforms, shader_quad_t const *quad, f32 color[4][4]);
+
+/*
+    Output of the vertex stage, one per unique vertex of a mesh
+*/
+typedef struct post_vertex_t
+{
+    clip_vertex_t   clip;
+    vec4f_t         screen;     // after the divide and the viewport, w keeps the clip w
+    u32             outcode;    // clip planes the vertex is outside of
+}post_vertex_t;
+
+/*
+    Triangle after setup in the binning front end, holds
+    everything the back end needs to rasterize it inside a tile
+*/
+typedef struct raster_tri_t
+{
+    vec4f_t     v0;             // screen space, reordered so det012 is positive
+    vec4f_t     v1;
+    vec4f_t     v2;
+    i32         edge_a[3];      // edge function steps per pixel in x and y, edge i is opposite to vertex i
+    i32         edge_b[3];
+    i32         edge_c[3];      // edge functions at the center of (xmin, ymin), top-left bias applied
+    plane_t     z;
+    plane_t     inv_w;          // 1/w, divides the attribute planes back out
+    plane_t     color[3];       // r, g, b divided by w
+    u32         flat_color;     // flat shading only, packed like the color buffer
+    f32         z_min;          // depth range of the vertices
+    f32         z_max;
+    i32         xmin;           // clamped bounding box, max is exclusive
+    i32         ymin;
+    i32         xmax;
+    i32         ymax;
+    u32         coverage;       // small triangles only, bit dx + dy * SMALL_TRI_SIZE for each covered pixel
+    plane_t     *varyings;      // programmable draws only, varying_count planes divided by w like the colors
+}raster_tri_t;
+
+typedef struct raster_stats_t
+{
+    u64         draws_culled;           // whole draws or instances outside the frustum
+    u64         meshlets_frustum_culled;
+    u64         meshlets_cone_culled;
+    u64         tris_binned;
+    u64         tris_small;             // took the small triangle path
+    u64         tris_hiz_rejected;      // rejected in every tile they touch
+    u64         tiles_hiz_rejected;     // triangle and tile pairs skipped
+    u64         blocks_edge_rejected;   // outside the triangle
+    u64         blocks_full;            // inside the triangle, no edge tests
+    u64         blocks_tested;          // against the depth hierarchy
+    u64         blocks_hiz_rejected;
+}raster_stats_t;
+
+/*
+    Rasterize the part of a triangle that falls inside [x0,x1) x [y0,y1)
+*/
+typedef void (*rasterize_fn_t)(framebuffer_t const *fb, draw_command_t const *command, raster_tri_t const *tri, i32 x0, i32 y0, i32 x1, i32 y1, raster_stats_t *stats);
+
+struct shader_t
+{
+    vertex_shader_fn_t      vertex;
+    fragment_shader_fn_t    fragment;
+    u32                     varying_count;  // at most MAX_VARYINGS
+    rasterize_fn_t          rasterize;      // optional, a kernel with the fragment shader inlined
+};
+
+typedef struct tile_bin_t
+{
+    u32         *items;         // indices into the owning thread triangle list
+    u32         count;
+    u32         capacity;
+}tile_bin_t;
+
+/*
+    Every front end thread owns a triangle list and one bin per tile so
+    binning needs no synchronization, threads work on contiguous ranges
+    of primitives so walking them in order keeps the submission order
+*/
+typedef struct raster_thread_t
+{
+    raster_tri_t    *tris;
+    u32             tri_count;
+    u32             tri_capacity;
+    plane_t         *varyings;      // varying planes of the triangles, kept apart so other draws do not carry them
+    size_t          varying_capacity;
+    tile_bin_t      *bins;          // one per screen tile
+    u32             bin_count;
+    raster_stats_t  stats;
+}raster_thread_t;
+
+/*
+    Per-instance state of the current draw, only instances that survive
+    culling are kept
+*/
+typedef struct draw_instance_t
+{
+    mat4x4_t        transform;      // instance transform followed by the draw transform
+    mat4x4_t        vertex_transform;   // transform of the raw position values, decode included
+    frustum_t       frustum;        // in the space of the mesh
+    vec3f_t         eye;
+    bool            cone;           // meshlet normal cones can cull
+    bool            tint;
+    color4_t        color;
+    u32             vertex_base;    // first post-transform vertex of the instance
+}draw_instance_t;
+
+typedef struct binner_t
+{
+    raster_thread_t threads[MAX_RASTER_THREADS];
+    u32             thread_count;
+    u32             tiles_x;
+    u32             tiles_y;
+    u32             tile_count;
+    post_vertex_t   *vertices;      // post-transform buffer of the current draw
+    u32             vertex_capacity;
+    f32             *varyings;      // varying_count per post-transform vertex, programmable draws only
+    size_t          varying_capacity;
+    draw_instance_t *instances;     // visible instances of the current draw
+    u32             instance_capacity;
+}binner_t;
+
+/*
+    Draw recorded into the visibility buffer, kept until the resolve. Its ids
+    start at first_record << VISIBILITY_TRIANGLE_BITS and number the triangles
+    of each visible instance in turn
+*/
+typedef struct visibility_draw_t
+{
+    draw_command_t  command;            // what it points to has to outlive the resolve
+    viewport_t      viewport;
+    u32             first_instance;     // into the visibility instances
+    u32             first_record;
+    u32             instance_triangles; // ids taken by one instance
+}visibility_draw_t;
+
+struct visibility_t
+{
+    image_view_t        ids;            // one id a pixel, stored in place of a color so the flat raster kernels write them
+    visibility_draw_t   *draws;
+    u32                 draw_count;
+    u32                 draw_capacity;
+    draw_instance_t     *instances;
+    u32                 instance_count;
+    u32                 instance_capacity;
+    u16                 record_draws[VISIBILITY_MAX_RECORDS];   // draw each record belongs to
+    u32                 record_count;
+};
+
+/*
+    Weighted blended order-independent transparency: translucent fragments
+    add their weighted color to a sum and multiply their transmittance into
+    a product, both commutative, and the resolve composites the weighted
+    average over the color buffer
+*/
+struct oit_t
+{
+    f32         *accum;             // rgb * a * weight and a * weight, four floats a pixel
+    f32         *revealage;         // product of 1 - a, the share of the background left visible
+    u32         width;
+    u32         height;
+    f32         view_near;          // view depth range the weights fall off over, that of the projection
+    f32         view_far;
+    bool        pending;            // a draw accumulated since the last resolve
+};
+
 struct context_t
 {
     SDL_Window*         window;
     image_view_t        draw_buffer;
+    depth_view_t        depth_buffer;
+    stencil_view_t      stencil_buffer;
+    hiz_t               hiz;
+    visibility_t        visibility;
+    oit_t               oit;
     u32                 screen_width;
     u32                 screen_height;
     u32                 mouseX;
@@ -178,6 +812,9 @@ struct context_t
     bool                dock;
     bool                debug;
     bool                capture;
+    bool                deferred;       // shade through the visibility buffer
+    bool                shaded;         // draw with the built-in shaders instead of the fixed-function pipeline
+    bool                transparent;    // draw the scene translucent through the oit buffers
     /* TIME */
     u32                 start_time;
     f32                 prev_time;
@@ -188,11 +825,17 @@ struct context_t
     SDL_Cursor*         hand_cursor;
     SDL_Cursor*         arrow_cursor;
     SDL_Surface*        icon;
+    texture_t           *texture;       // optional, on the cube of the shaded pipeline
 }gc;
 
 f32 curr_time = 0.f;
 SDL_Surface* draw_surface;
 
+global_variable binner_t binner;
+global_variable command_buffer_t commands;
+global_variable cpu_features_t cpu;
+global_variable texture_cache_t texture_caches[MAX_RASTER_THREADS];
+
 global_variable vec3f_t cube_positions[] =
 {
     // -X face
@@ -271,7 +914,23 @@ global_variable color4_t cube_colors[] =
     {124.f, 252.f, 0.f, 255.f},      
 };
 
-global_variable u32 cube_indices[] =
+global_variable vec2f_t cube_texcoords[] =
+{
+    // -X face
+    {0.f, 0.f}, {1.f, 0.f}, {0.f, 1.f}, {1.f, 1.f},
+    // +X face
+    {0.f, 0.f}, {1.f, 0.f}, {0.f, 1.f}, {1.f, 1.f},
+    // -Y face
+    {0.f, 0.f}, {1.f, 0.f}, {0.f, 1.f}, {1.f, 1.f},
+    // +Y face
+    {0.f, 0.f}, {1.f, 0.f}, {0.f, 1.f}, {1.f, 1.f},
+    // -Z face
+    {0.f, 0.f}, {1.f, 0.f}, {0.f, 1.f}, {1.f, 1.f},
+    // +Z face
+    {0.f, 0.f}, {1.f, 0.f}, {0.f, 1.f}, {1.f, 1.f},
+};
+
+global_variable u8 cube_indices[] =
 {
     // -X face
      0,  2,  1,
@@ -298,6 +957,8 @@ global_variable u32 cube_indices[] =
     21, 23, 22,
 };
 
+global_variable bounds_t cube_bounds;      // computed once with the rest of the cube in init_all
+
 fn mat4x4_t mat_identity(void)
 {
     return (mat4x4_t){
@@ -377,6 +1038,9 @@ fn mat4x4_t mat_rotate_zx(f32 angle)
     };
 }
 
+/*
+    Depth after the perspective divide is in [0,1], 0 at the near plane
+*/
 fn mat4x4_t mat_perspective(f32 n, f32 f, f32 fovY, f32 aspect_ratio)
 {
     f32 top   = n * tanf(fovY / 2.f);
@@ -385,11 +1049,28 @@ fn mat4x4_t mat_perspective(f32 n, f32 f, f32 fovY, f32 aspect_ratio)
     return (mat4x4_t) {
         n / right,      0.f,       0.f,                    0.f,
         0.f,            n / top,   0.f,                    0.f,
-        0.f,            0.f,       -(f + n) / (f - n),     - 2.f * f * n / (f - n),
+        0.f,            0.f,       -f / (f - n),           - f * n / (f - n),
         0.f,            0.f,       -1.f,                   0.f,
     };
 }
 
+/*
+    Same as mat_perspective with depth going from 1 at the near plane to 0 at
+    the far plane, float depth then keeps its precision far away from the camera
+*/
+fn mat4x4_t mat_perspective_reverse_z(f32 n, f32 f, f32 fovY, f32 aspect_ratio)
+{
+    f32 top   = n * tanf(fovY / 2.f);
+    f32 right = top * aspect_ratio;
+
+    return (mat4x4_t) {{
+        n / right,      0.f,       0.f,                    0.f,
+        0.f,            n / top,   0.f,                    0.f,
+        0.f,            0.f,       n / (f - n),            f * n / (f - n),
+        0.f,            0.f,       -1.f,                   0.f,
+    }};
+}
+
 fn vec4f_t viewport_apply(viewport_t const *vp, vec4f_t v)
 {
     v.x = (f32)vp->xmin + (f32)(vp->xmax - vp->xmin) * (0.5f + 0.5f * v.x);
@@ -397,28 +1078,6 @@ fn vec4f_t viewport_apply(viewport_t const *vp, vec4f_t v)
     return v;
 }
 
-fn vec4f_t vec4f_mat_mul_SIMD(mat4x4_t const *m, vec4f_t const *v) 
-{
-    __m128 vec = _mm_set_ps(v->w, v->z, v->y, v->x);
-
-    __m128 col0 = _mm_loadu_ps(&m->values[0]);
-    __m128 col1 = _mm_loadu_ps(&m->values[4]);
-    __m128 col2 = _mm_loadu_ps(&m->values[8]);
-    __m128 col3 = _mm_loadu_ps(&m->values[12]);
-
-    __m128 result_x = _mm_mul_ps(col0, vec);
-    __m128 result_y = _mm_mul_ps(col1, vec);
-    __m128 result_z = _mm_mul_ps(col2, vec);
-    __m128 result_w = _mm_mul_ps(col3, vec);
-
-    f32 x = _mm_cvtss_f32(_mm_hadd_ps(_mm_hadd_ps(result_x, result_x), result_x));
-    f32 y = _mm_cvtss_f32(_mm_hadd_ps(_mm_hadd_ps(result_y, result_y), result_y));
-    f32 z = _mm_cvtss_f32(_mm_hadd_ps(_mm_hadd_ps(result_z, result_z), result_z));
-    f32 w = _mm_cvtss_f32(_mm_hadd_ps(_mm_hadd_ps(result_w, result_w), result_w));
-
-    return (vec4f_t){x, y, z, w};
-}
-
 fn vec4f_t vec4f_mat_mul(mat4x4_t const *m, vec4f_t const *v)
 {
     return (vec4f_t){
@@ -529,6 +1188,114 @@ fn mat4x4_t mat4x4_mult_simd(mat4x4_t const *m, mat4x4_t const *n)
 }
 
 
+/*
+    Frustum of a clip space transform in the space its input is given in,
+    clip z is in [0,1]
+*/
+fn frustum_t frustum_from_matrix(mat4x4_t const *m)
+{
+    f32 const *v = m->values;
+
+    vec4f_t const r0 = {v[ 0], v[ 1], v[ 2], v[ 3]};
+    vec4f_t const r1 = {v[ 4], v[ 5], v[ 6], v[ 7]};
+    vec4f_t const r2 = {v[ 8], v[ 9], v[10], v[11]};
+    vec4f_t const r3 = {v[12], v[13], v[14], v[15]};
+
+    frustum_t f = {{
+        {r3.x + r0.x, r3.y + r0.y, r3.z + r0.z, r3.w + r0.w},   // left
+        {r3.x - r0.x, r3.y - r0.y, r3.z - r0.z, r3.w - r0.w},   // right
+        {r3.x + r1.x, r3.y + r1.y, r3.z + r1.z, r3.w + r1.w},   // bottom
+        {r3.x - r1.x, r3.y - r1.y, r3.z - r1.z, r3.w - r1.w},   // top
+        r2,                                                     // z >= 0
+        {r3.x - r2.x, r3.y - r2.y, r3.z - r2.z, r3.w - r2.w},   // z <= w
+    }};
+
+    for (u32 i = 0; i < 6; ++i)
+    {
+        vec4f_t *p = &f.planes[i];
+        f32 const len = sqrtf(p->x * p->x + p->y * p->y + p->z * p->z);
+
+        if (len > 0.f) {
+            p->x /= len;
+            p->y /= len;
+            p->z /= len;
+            p->w /= len;
+        }
+    }
+    return f;
+}
+
+/*
+    True when the sphere lies completely outside one of the planes
+*/
+fn inline bool frustum_cull_sphere(frustum_t const *f, vec3f_t const *center, f32 radius)
+{
+    for (u32 i = 0; i < 6; ++i)
+    {
+        vec4f_t const *p = &f->planes[i];
+
+        if (p->x * center->x + p->y * center->y + p->z * center->z + p->w < -radius) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    True when the box lies completely outside one of the planes, tests the
+    corner furthest along each plane normal
+*/
+fn inline bool frustum_cull_aabb(frustum_t const *f, vec3f_t const *min, vec3f_t const *max)
+{
+    for (u32 i = 0; i < 6; ++i)
+    {
+        vec4f_t const *p = &f->planes[i];
+
+        f32 const x = p->x >= 0.f ? max->x : min->x;
+        f32 const y = p->y >= 0.f ? max->y : min->y;
+        f32 const z = p->z >= 0.f ? max->z : min->z;
+
+        if (p->x * x + p->y * y + p->z * z + p->w < 0.f) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    True when the bounds are outside the frustum, the sphere rejects most draws
+    and the box catches the ones near the corners of the frustum
+*/
+fn inline bool frustum_cull_bounds(frustum_t const *f, bounds_t const *b)
+{
+    return frustum_cull_sphere(f, &b->center, b->radius) || frustum_cull_aabb(f, &b->min, &b->max);
+}
+
+fn inline f32 det3(f32 a, f32 b, f32 c, f32 d, f32 e, f32 f, f32 g, f32 h, f32 i)
+{
+    return a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+}
+
+/*
+    Eye position of a transform in homogeneous coordinates of the space its
+    input is given in, the only point that lands on x = y = w = 0. The w is 0
+    for orthographic projections, otherwise its sign is the handedness of the
+    x, y and w rows, which decides how windings land on screen.
+*/
+fn vec4f_t mat_eye_position(mat4x4_t const *m)
+{
+    f32 const *a = &m->values[0];
+    f32 const *b = &m->values[4];
+    f32 const *c = &m->values[12];
+
+    f32 const x =  det3(a[1], a[2], a[3], b[1], b[2], b[3], c[1], c[2], c[3]);
+    f32 const y = -det3(a[0], a[2], a[3], b[0], b[2], b[3], c[0], c[2], c[3]);
+    f32 const z =  det3(a[0], a[1], a[3], b[0], b[1], b[3], c[0], c[1], c[3]);
+    f32 const w = -det3(a[0], a[1], a[2], b[0], b[1], b[2], c[0], c[1], c[2]);
+
+    return (vec4f_t){x, y, z, w};
+}
+
 fn SDL_Surface *surface_from_image(const char *path)
 {
     int req_format = STBI_rgb_alpha;
@@ -615,6 +1382,19 @@ fn inline void vecf4_swap (vec4f_t *v0, vec4f_t *v1)
     *v1 = tmp;
 }
 
+/*
+    product of two colors in 0->255 range, rounded
+*/
+fn inline color4_t color4_modulate(color4_t const c0, color4_t const c1)
+{
+    return (color4_t){
+        (u8)((c0.r * c1.r + 127) / 255),
+        (u8)((c0.g * c1.g + 127) / 255),
+        (u8)((c0.b * c1.b + 127) / 255),
+        (u8)((c0.a * c1.a + 127) / 255),
+    };
+}
+
 fn inline void color4_swap (color4_t *c0, color4_t *c1)
 {
     color4_t const tmp = *c0;
@@ -633,13 +1413,53 @@ fn inline f32 vec4f_dot(vec4f_t const *v0, vec4f_t const* v1)
     return v0->x * v1->x + v0->y * v1->y + v0->z * v1->z + v0->w * v1->w;
 }
 
-/* ----------------  Events -------------------- */
-fn void poll_events()
+fn inline vec3f_t vec3f_add(vec3f_t const *v0, vec3f_t const *v1)
 {
-    //ZoneScoped;
+    return (vec3f_t){v0->x + v1->x, v0->y + v1->y, v0->z + v1->z};
+}
 
-    SDL_Event event = {0};
-    const Uint8 *keyboard_state_array = SDL_GetKeyboardState(NULL);
+fn inline vec3f_t vec3f_sub(vec3f_t const *v0, vec3f_t const *v1)
+{
+    return (vec3f_t){v0->x - v1->x, v0->y - v1->y, v0->z - v1->z};
+}
+
+fn inline vec3f_t vec3f_scale(vec3f_t const *v, f32 s)
+{
+    return (vec3f_t){v->x * s, v->y * s, v->z * s};
+}
+
+fn inline f32 vec3f_dot(vec3f_t const *v0, vec3f_t const *v1)
+{
+    return v0->x * v1->x + v0->y * v1->y + v0->z * v1->z;
+}
+
+fn inline vec3f_t vec3f_cross(vec3f_t const *v0, vec3f_t const *v1)
+{
+    return (vec3f_t){
+        v0->y * v1->z - v0->z * v1->y,
+        v0->z * v1->x - v0->x * v1->z,
+        v0->x * v1->y - v0->y * v1->x,
+    };
+}
+
+fn inline f32 vec3f_length(vec3f_t const *v)
+{
+    return sqrtf(vec3f_dot(v, v));
+}
+
+fn inline vec3f_t vec3f_normalize(vec3f_t const *v)
+{
+    f32 const len = vec3f_length(v);
+    return len > 0.f ? vec3f_scale(v, 1.f / len) : *v;
+}
+
+/* ----------------  Events -------------------- */
+fn void poll_events()
+{
+    //ZoneScoped;
+
+    SDL_Event event = {0};
+    const Uint8 *keyboard_state_array = SDL_GetKeyboardState(NULL);
 
     while (SDL_PollEvent(&event)) 
     {
@@ -691,8 +1511,10 @@ fn void poll_events()
                     case SDLK_ESCAPE:
                         break;
                     case SDLK_BACKSPACE:
+                        gc.transparent ^= 1;
                         break;
                     case SDLK_RETURN:
+                        gc.shaded ^= 1;
                         break;
                     case SDLK_LEFT:
                         break;
@@ -715,6 +1537,7 @@ fn void poll_events()
                     case SDLK_END:
                     break;
                     case SDLK_TAB:
+                        gc.deferred ^= 1;
                     break;
                     case SDLK_LSHIFT:
                     case SDLK_RSHIFT:
@@ -821,6 +1644,143 @@ fn void clear_screen(image_view_t const *color_buf, color4_t const color)
     }
 }
 
+fn u32 depth_format_size(depth_format_t format)
+{
+    return format == DEPTH_FORMAT_D16 ? sizeof(u16) : sizeof(u32);
+}
+
+fn void depth_view_resize(depth_view_t *depth, u32 width, u32 height)
+{
+    free(depth->pixels);
+    depth->pixels = CHECK_PTR(malloc((size_t)width * height * depth_format_size(depth->format)));
+    depth->width  = width;
+    depth->height = height;
+
+    hiz_t *hiz = depth->hiz;
+
+    if (hiz)
+    {
+        hiz->blocks_x = (width  + HIZ_BLOCK_SIZE - 1) >> HIZ_BLOCK_SIZE_LOG2;
+        hiz->blocks_y = (height + HIZ_BLOCK_SIZE - 1) >> HIZ_BLOCK_SIZE_LOG2;
+        hiz->tiles_x  = (width  + TILE_SIZE - 1) >> TILE_SIZE_LOG2;
+        hiz->tiles_y  = (height + TILE_SIZE - 1) >> TILE_SIZE_LOG2;
+
+        free(hiz->blocks);
+        free(hiz->tiles);
+        hiz->blocks = (depth_bounds_t *)CHECK_PTR(malloc(sizeof(depth_bounds_t) * hiz->blocks_x * hiz->blocks_y));
+        hiz->tiles  = (depth_bounds_t *)CHECK_PTR(malloc(sizeof(depth_bounds_t) * hiz->tiles_x * hiz->tiles_y));
+    }
+}
+
+/*
+    Scalar version of the quantization done by the raster kernels
+*/
+fn inline i32 depth_quantize(depth_format_t format, f32 z)
+{
+    z = MAX(0.f, MIN(1.f, z));
+
+    switch (format)
+    {
+        case DEPTH_FORMAT_D16:
+            return (i32)(z * 65535.f + 0.5f);
+        case DEPTH_FORMAT_D24:
+            return (i32)(z * 16777215.f + 0.5f);
+        case DEPTH_FORMAT_D32F:
+        default:{
+            i32 bits;
+            memcpy(&bits, &z, sizeof(bits));
+            return bits;
+        }
+    }
+}
+
+/*
+    True when no depth in [zmin, zmax] can pass the comparison against any
+    stored depth in the bounds, only monotonic comparisons can reject
+*/
+fn inline bool hiz_reject(compare_op_t op, depth_bounds_t stored, i32 zmin, i32 zmax)
+{
+    switch (op)
+    {
+        case COMPARE_NEVER:         return true;
+        case COMPARE_LESS:          return zmin >= stored.max;
+        case COMPARE_LESS_EQUAL:    return zmin >  stored.max;
+        case COMPARE_GREATER:       return zmax <= stored.min;
+        case COMPARE_GREATER_EQUAL: return zmax <  stored.min;
+        default:                    return false;
+    }
+}
+
+/*
+    Quantized depth range of [zmin, zmax], widened a little so float differences
+    with the per pixel interpolation can never reject a passing pixel
+*/
+fn inline depth_bounds_t depth_bounds_quantize(depth_format_t format, f32 zmin, f32 zmax)
+{
+    return (depth_bounds_t){
+        .min = depth_quantize(format, zmin - fabsf(zmin) * 1e-5f - 1e-7f),
+        .max = depth_quantize(format, zmax + fabsf(zmax) * 1e-5f + 1e-7f),
+    };
+}
+
+fn void clear_depth(depth_view_t const *depth)
+{
+    size_t const count = (size_t)depth->width * depth->height;
+
+    switch (depth->format)
+    {
+        case DEPTH_FORMAT_D16:{
+            u16 const value = depth->reverse_z ? 0 : 0xFFFF;
+            u16 *pixels = (u16 *)depth->pixels;
+            for (size_t i = 0; i < count; ++i) {
+                pixels[i] = value;
+            }
+        }break;
+        case DEPTH_FORMAT_D24:{
+            u32 const value = depth->reverse_z ? 0 : 0xFFFFFF;
+            u32 *pixels = (u32 *)depth->pixels;
+            for (size_t i = 0; i < count; ++i) {
+                pixels[i] = value;
+            }
+        }break;
+        case DEPTH_FORMAT_D32F:{
+            f32 const value = depth->reverse_z ? 0.f : 1.f;
+            f32 *pixels = (f32 *)depth->pixels;
+            for (size_t i = 0; i < count; ++i) {
+                pixels[i] = value;
+            }
+        }break;
+    }
+
+    hiz_t *hiz = depth->hiz;
+
+    if (hiz)
+    {
+        i32 const value = depth_quantize(depth->format, depth->reverse_z ? 0.f : 1.f);
+        depth_bounds_t const bounds = {value, value};
+
+        for (u32 i = 0; i < hiz->blocks_x * hiz->blocks_y; ++i) {
+            hiz->blocks[i] = bounds;
+        }
+        for (u32 i = 0; i < hiz->tiles_x * hiz->tiles_y; ++i) {
+            hiz->tiles[i] = bounds;
+        }
+    }
+}
+
+fn void stencil_view_resize(stencil_view_t *stencil, u32 width, u32 height)
+{
+    free(stencil->pixels);
+    stencil->pixels = (u8 *)CHECK_PTR(malloc((size_t)width * height));
+    stencil->width  = width;
+    stencil->height = height;
+}
+
+fn void clear_stencil(stencil_view_t const *stencil, u8 value)
+{
+    memset(stencil->pixels, value, (size_t)stencil->width * stencil->height);
+}
+
 fn void swap(int* a, int* b) 
 {
     int temp = *a;
@@ -838,6 +1798,335 @@ fn color4_t get_random_color(void)
     };
 }
 
+/* ----------------  Attributes -------------------- */
+
+fn f32 f16_to_f32(u16 h)
+{
+    u32 const exponent = (h >> 10) & 0x1F;
+    u32 const mantissa = h & 0x3FF;
+
+    f32 magnitude;
+
+    if (exponent == 0) {
+        magnitude = ldexpf((f32)mantissa, -24);
+    } else if (exponent == 0x1F) {
+        magnitude = mantissa ? NAN : INFINITY;
+    } else {
+        magnitude = ldexpf((f32)(mantissa | 0x400), (i32)exponent - 25);
+    }
+    return (h & 0x8000) ? -magnitude : magnitude;
+}
+
+fn inline u8 unorm_to_u8(f32 v)
+{
+    return (u8)(MAX(0.f, MIN(1.f, v)) * 255.f + 0.5f);
+}
+
+/*
+    Color i of a color attribute, converted from its format to 8 bits a channel
+*/
+fn color4_t attribute_color(attribute_t colors, u32 i)
+{
+    void const *value = ATTR_AT(colors, i);
+
+    switch (colors.format)
+    {
+        case ATTRIBUTE_FORMAT_F32:
+        {
+            f32 const *c = (f32 const *)value;
+            return (color4_t){unorm_to_u8(c[0]), unorm_to_u8(c[1]), unorm_to_u8(c[2]), unorm_to_u8(c[3])};
+        }
+        case ATTRIBUTE_FORMAT_F16:
+        {
+            u16 const *c = (u16 const *)value;
+            return (color4_t){unorm_to_u8(f16_to_f32(c[0])), unorm_to_u8(f16_to_f32(c[1])),
+                              unorm_to_u8(f16_to_f32(c[2])), unorm_to_u8(f16_to_f32(c[3]))};
+        }
+        case ATTRIBUTE_FORMAT_SNORM16:
+        {
+            // negative channels clamp to 0
+            i16 const *c = (i16 const *)value;
+            return (color4_t){unorm_to_u8(c[0] / 32767.f), unorm_to_u8(c[1] / 32767.f),
+                              unorm_to_u8(c[2] / 32767.f), unorm_to_u8(c[3] / 32767.f)};
+        }
+        case ATTRIBUTE_FORMAT_UNORM10_10_10_2:
+        {
+            u32 const c = *(u32 const *)value;
+            return (color4_t){
+                (u8)(((c & 0x3FF) * 255 + 511) / 1023),
+                (u8)((((c >> 10) & 0x3FF) * 255 + 511) / 1023),
+                (u8)((((c >> 20) & 0x3FF) * 255 + 511) / 1023),
+                (u8)((c >> 30) * 85),
+            };
+        }
+        default:
+            return *(color4_t const *)value;
+    }
+}
+
+/*
+    Map from the raw values the transform kernels read from the positions of a
+    mesh to object space: the normalization of their format followed by the
+    quantization of the mesh. False when positions are read as they are
+*/
+fn bool position_decode(mesh_t const *mesh, mat4x4_t *decode)
+{
+    f32 normalize;
+
+    switch (mesh->positions.format)
+    {
+        case ATTRIBUTE_FORMAT_SNORM16:          normalize = 1.f / 32767.f; break;
+        case ATTRIBUTE_FORMAT_UNORM8:           normalize = 1.f / 255.f;   break;
+        case ATTRIBUTE_FORMAT_UNORM10_10_10_2:  normalize = 1.f / 1023.f;  break;
+        default:                                normalize = 1.f;           break;
+    }
+
+    if (normalize == 1.f && !mesh->position_quantization) {
+        return false;
+    }
+
+    quantization_t const q = mesh->position_quantization ? *mesh->position_quantization :
+                             (quantization_t){.scale = {1.f, 1.f, 1.f}};
+
+    *decode = (mat4x4_t){{
+        q.scale.x * normalize, 0.f,                   0.f,                   q.offset.x,
+        0.f,                   q.scale.y * normalize, 0.f,                   q.offset.y,
+        0.f,                   0.f,                   q.scale.z * normalize, q.offset.z,
+        0.f,                   0.f,                   0.f,                   1.f,
+    }};
+    return true;
+}
+
+/* ----------------  Bounds -------------------- */
+
+fn bounds_t bounds_from_positions(vec3f_t const *positions, u32 count)
+{
+    bounds_t b = {0};
+
+    if (!count) {
+        return b;
+    }
+
+    b.min = positions[0];
+    b.max = positions[0];
+
+    for (u32 i = 1; i < count; ++i)
+    {
+        vec3f_t const p = positions[i];
+        b.min = (vec3f_t){MIN(b.min.x, p.x), MIN(b.min.y, p.y), MIN(b.min.z, p.z)};
+        b.max = (vec3f_t){MAX(b.max.x, p.x), MAX(b.max.y, p.y), MAX(b.max.z, p.z)};
+    }
+
+    vec3f_t const sum = vec3f_add(&b.min, &b.max);
+    b.center = vec3f_scale(&sum, 0.5f);
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        vec3f_t const d = vec3f_sub(&positions[i], &b.center);
+        b.radius = MAX(b.radius, vec3f_length(&d));
+    }
+    return b;
+}
+
+/* ----------------  Meshlets -------------------- */
+
+/*
+    Bounding sphere and normal cone of a meshlet, the cone is left disabled when
+    the triangles face too many directions for it to ever cull
+*/
+fn void meshlet_compute_bounds(meshlet_t *m, model_t const *model)
+{
+    vec3f_t lo = model->positions[model->meshlet_vertices[m->vertex_offset]];
+    vec3f_t hi = lo;
+
+    for (u32 i = 1; i < m->vertex_count; ++i)
+    {
+        vec3f_t const p = model->positions[model->meshlet_vertices[m->vertex_offset + i]];
+        lo = (vec3f_t){MIN(lo.x, p.x), MIN(lo.y, p.y), MIN(lo.z, p.z)};
+        hi = (vec3f_t){MAX(hi.x, p.x), MAX(hi.y, p.y), MAX(hi.z, p.z)};
+    }
+
+    vec3f_t const sum = vec3f_add(&lo, &hi);
+    m->center = vec3f_scale(&sum, 0.5f);
+    m->radius = 0.f;
+
+    for (u32 i = 0; i < m->vertex_count; ++i)
+    {
+        vec3f_t const p = model->positions[model->meshlet_vertices[m->vertex_offset + i]];
+        vec3f_t const d = vec3f_sub(&p, &m->center);
+        m->radius = MAX(m->radius, vec3f_length(&d));
+    }
+
+    // cone around the average normal that contains every triangle normal
+    vec3f_t normals[MESHLET_MAX_TRIANGLES];
+    vec3f_t corners[MESHLET_MAX_TRIANGLES];
+    vec3f_t axis = {0};
+
+    u32 count = 0;
+
+    for (u32 t = 0; t < m->triangle_count; ++t)
+    {
+        u8 const *tri = &model->meshlet_triangles[(m->triangle_offset + t) * 3];
+
+        vec3f_t const p0 = model->positions[model->meshlet_vertices[m->vertex_offset + tri[0]]];
+        vec3f_t const p1 = model->positions[model->meshlet_vertices[m->vertex_offset + tri[1]]];
+        vec3f_t const p2 = model->positions[model->meshlet_vertices[m->vertex_offset + tri[2]]];
+
+        vec3f_t const e1 = vec3f_sub(&p1, &p0);
+        vec3f_t const e2 = vec3f_sub(&p2, &p0);
+        vec3f_t const n  = vec3f_cross(&e1, &e2);
+
+        if (vec3f_length(&n) == 0.f) {
+            continue;
+        }
+        normals[count] = vec3f_normalize(&n);
+        corners[count] = p0;
+        axis = vec3f_add(&axis, &normals[count]);
+        count++;
+    }
+
+    axis = vec3f_normalize(&axis);
+
+    f32 min_dot = 1.f;
+
+    for (u32 i = 0; i < count; ++i) {
+        min_dot = MIN(min_dot, vec3f_dot(&normals[i], &axis));
+    }
+
+    m->cone_apex   = m->center;
+    m->cone_axis   = axis;
+    m->cone_cutoff = 2.f;
+
+    if (!count || min_dot <= 0.1f) {
+        return;
+    }
+
+    // move the apex back until every triangle plane is in front of it
+    f32 max_t = 0.f;
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        vec3f_t const d = vec3f_sub(&m->center, &corners[i]);
+        max_t = MAX(max_t, vec3f_dot(&d, &normals[i]) / vec3f_dot(&axis, &normals[i]));
+    }
+
+    vec3f_t const offset = vec3f_scale(&axis, max_t);
+    m->cone_apex   = vec3f_sub(&m->center, &offset);
+    m->cone_cutoff = sqrtf(1.f - min_dot * min_dot);
+}
+
+/*
+    Split the index list into meshlets in order, a meshlet is closed as soon
+    as the next triangle would exceed one of the limits
+*/
+fn void model_build_meshlets(model_t *model)
+{
+    u32 const tri_count = model->index_count / 3;
+
+    model->meshlets          = (meshlet_t *)CHECK_PTR(malloc(sizeof(meshlet_t) * MAX(tri_count, 1)));
+    model->meshlet_vertices  = (u32 *)CHECK_PTR(malloc(sizeof(u32) * MAX(model->index_count, 1)));
+    model->meshlet_triangles = (u8 *)CHECK_PTR(malloc(MAX(model->index_count, 1)));
+
+    model->meshlet_count          = 0;
+    model->meshlet_vertex_count   = 0;
+    model->meshlet_triangle_count = 0;
+
+    // local index of each mesh vertex in the current meshlet
+    u8 *local = (u8 *)CHECK_PTR(malloc(MAX(model->vertex_count, 1)));
+    memset(local, 0xFF, model->vertex_count);
+
+    meshlet_t m = {0};
+
+    for (u32 t = 0; t < tri_count; ++t)
+    {
+        u32 const *idx = &model->indices[t * 3];
+
+        u32 const added = (u32)((local[idx[0]] == 0xFF) + (local[idx[1]] == 0xFF && idx[1] != idx[0]) +
+                                (local[idx[2]] == 0xFF && idx[2] != idx[0] && idx[2] != idx[1]));
+
+        if (m.vertex_count + added > MESHLET_MAX_VERTICES || m.triangle_count == MESHLET_MAX_TRIANGLES)
+        {
+            for (u32 i = 0; i < m.vertex_count; ++i) {
+                local[model->meshlet_vertices[m.vertex_offset + i]] = 0xFF;
+            }
+            model->meshlets[model->meshlet_count++] = m;
+
+            m = (meshlet_t){
+                .vertex_offset   = model->meshlet_vertex_count,
+                .triangle_offset = model->meshlet_triangle_count,
+            };
+        }
+
+        for (u32 k = 0; k < 3; ++k)
+        {
+            if (local[idx[k]] == 0xFF) {
+                local[idx[k]] = (u8)m.vertex_count;
+                model->meshlet_vertices[model->meshlet_vertex_count++] = idx[k];
+                m.vertex_count++;
+            }
+            model->meshlet_triangles[model->meshlet_triangle_count * 3 + k] = local[idx[k]];
+        }
+        model->meshlet_triangle_count++;
+        m.triangle_count++;
+    }
+
+    if (m.triangle_count) {
+        model->meshlets[model->meshlet_count++] = m;
+    }
+    free(local);
+
+    for (u32 i = 0; i < model->meshlet_count; ++i) {
+        meshlet_compute_bounds(&model->meshlets[i], model);
+    }
+
+    model->meshlets          = (meshlet_t *)CHECK_PTR(realloc(model->meshlets, sizeof(meshlet_t) * MAX(model->meshlet_count, 1)));
+    model->meshlet_vertices  = (u32 *)CHECK_PTR(realloc(model->meshlet_vertices, sizeof(u32) * MAX(model->meshlet_vertex_count, 1)));
+    model->meshlet_triangles = (u8 *)CHECK_PTR(realloc(model->meshlet_triangles, MAX(model->meshlet_triangle_count * 3, 1)));
+}
+
+/* ----------------  Quantization -------------------- */
+
+/*
+    snorm16 copy of the positions of a model over its bounding box, half the
+    size of the float positions. The float positions are snapped to the values
+    the copy decodes to, so bounds and meshlets built from them hold exactly
+*/
+fn void model_quantize(model_t *model)
+{
+    bounds_t const bounds = bounds_from_positions(model->positions, model->vertex_count);
+
+    vec3f_t const extent = vec3f_sub(&bounds.max, &bounds.min);
+    quantization_t *q    = &model->quantization;
+
+    q->offset = bounds.center;
+    q->scale  = (vec3f_t){
+        extent.x > 0.f ? extent.x * 0.5f : 1.f,
+        extent.y > 0.f ? extent.y * 0.5f : 1.f,
+        extent.z > 0.f ? extent.z * 0.5f : 1.f,
+    };
+
+    model->quantized_positions = (vec3i16_t *)CHECK_PTR(malloc(sizeof(vec3i16_t) * MAX(model->vertex_count, 1)));
+
+    for (u32 i = 0; i < model->vertex_count; ++i)
+    {
+        vec3f_t *p = &model->positions[i];
+
+        f32 const x = MAX(-1.f, MIN(1.f, (p->x - q->offset.x) / q->scale.x));
+        f32 const y = MAX(-1.f, MIN(1.f, (p->y - q->offset.y) / q->scale.y));
+        f32 const z = MAX(-1.f, MIN(1.f, (p->z - q->offset.z) / q->scale.z));
+
+        vec3i16_t const v = {(i16)lrintf(x * 32767.f), (i16)lrintf(y * 32767.f), (i16)lrintf(z * 32767.f)};
+
+        model->quantized_positions[i] = v;
+
+        *p = (vec3f_t){
+            q->offset.x + q->scale.x * ((f32)v.x / 32767.f),
+            q->offset.y + q->scale.y * ((f32)v.y / 32767.f),
+            q->offset.z + q->scale.z * ((f32)v.z / 32767.f),
+        };
+    }
+}
+
 fn model_t* load_obj(const char *filename)
 {
     FILE *file = fopen(filename, "r");
@@ -902,12 +2191,23 @@ fn model_t* load_obj(const char *filename)
             }
 
             u32 v1, v2, v3;
-            // Simple face parsing (assumes triangular faces with 1-based indexing)
-            if (sscanf(line, "f %u %u %u", &v1, &v2, &v3) == 3) {
+            // Simple face parsing (assumes triangular faces with 1-based indexing),
+            // also with texture/normal indices (f v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3)
+            if (sscanf(line, "f %u %u %u", &v1, &v2, &v3) == 3 ||
+                sscanf(line, "f %u/%*u/%*u %u/%*u/%*u %u/%*u/%*u", &v1, &v2, &v3) == 3 ||
+                sscanf(line, "f %u//%*u %u//%*u %u//%*u", &v1, &v2, &v3) == 3 ||
+                sscanf(line, "f %u/%*u %u/%*u %u/%*u", &v1, &v2, &v3) == 3) {
                 // Convert from 1-based to 0-based indexing
                 u32 i0 = v1 - 1;
                 u32 i1 = v2 - 1;
                 u32 i2 = v3 - 1;
+
+                // faces can only use vertices defined before them, checking
+                // here once means draws never have to
+                if (i0 >= model->vertex_count || i1 >= model->vertex_count || i2 >= model->vertex_count) {
+                    fprintf(stderr, "Skipping face with an undefined vertex in %s: %s", filename, line);
+                    continue;
+                }
                 
                 // Generate random color for this triangle
                 color4_t triangle_color = get_random_color();
@@ -917,25 +2217,6 @@ fn model_t* load_obj(const char *filename)
                 model->colors[i1] = triangle_color;
                 model->colors[i2] = triangle_color;
                 
-                model->indices[model->index_count++] = i0;
-                model->indices[model->index_count++] = i1;
-                model->indices[model->index_count++] = i2;
-            }
-            // Handle face format with texture/normal indices (f v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3)
-            else if (sscanf(line, "f %u/%*u/%*u %u/%*u/%*u %u/%*u/%*u", &v1, &v2, &v3) == 3 ||
-                     sscanf(line, "f %u//%*u %u//%*u %u//%*u", &v1, &v2, &v3) == 3 ||
-                     sscanf(line, "f %u/%*u %u/%*u %u/%*u", &v1, &v2, &v3) == 3) {
-                
-                u32 i0 = v1 - 1;
-                u32 i1 = v2 - 1;
-                u32 i2 = v3 - 1;
-                
-                color4_t triangle_color = get_random_color();
-                
-                model->colors[i0] = triangle_color;
-                model->colors[i1] = triangle_color;
-                model->colors[i2] = triangle_color;
-                
                 model->indices[model->index_count++] = i0;
                 model->indices[model->index_count++] = i1;
                 model->indices[model->index_count++] = i2;
@@ -949,8 +2230,12 @@ fn model_t* load_obj(const char *filename)
     model->colors = (color4_t*)realloc(model->colors, sizeof(color4_t) * model->vertex_count);
     model->indices = (u32*)realloc(model->indices, sizeof(u32) * model->index_count);
 
-    printf("Loaded OBJ: %u vertices, %u indices (%u triangles)\n", 
-           model->vertex_count, model->index_count, model->index_count / 3);
+    model_quantize(model);
+    model->bounds = bounds_from_positions(model->positions, model->vertex_count);
+    model_build_meshlets(model);
+
+    printf("Loaded OBJ: %u vertices, %u indices (%u triangles), %u meshlets\n", 
+           model->vertex_count, model->index_count, model->index_count / 3, model->meshlet_count);
     return model;
 }
 
@@ -959,8 +2244,12 @@ fn void free_model(model_t *model)
 {
     if (model) {
         free(model->positions);
+        free(model->quantized_positions);
         free(model->colors);
         free(model->indices);
+        free(model->meshlets);
+        free(model->meshlet_vertices);
+        free(model->meshlet_triangles);
         free(model);
     }
 }
@@ -1031,145 +2320,3670 @@ fn void draw_line(image_view_t const *color_buf, int x0, int y0, int x1, int y1,
     }
 }
 
-fn void draw_mesh(image_view_t const *color_buf, draw_command_t const *command, viewport_t const *vp)
+/* ----------------  CPU -------------------- */
+fn void cpuid(u32 leaf, u32 subleaf, u32 regs[4])
 {
-    for(size_t vidx = 0;
-        vidx + 2 < command->mesh.count;
-        vidx+=3)
-    {
-        u32 i0 = vidx+0;
-        u32 i1 = vidx+1;
-        u32 i2 = vidx+2;
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, (int)leaf, (int)subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
 
-        if(command->mesh.indices)
-        {
-            i0 = command->mesh.indices[i0];
-            i1 = command->mesh.indices[i1];
-            i2 = command->mesh.indices[i2];
-        }
+fn u64 xgetbv(u32 index)
+{
+#ifdef _MSC_VER
+    return _xgetbv(index);
+#else
+    u32 lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return ((u64)hi << 32) | lo;
+#endif
+}
 
-        vec4f_t p0 = vecf4_as_point((vec3f_t *)ATTR_AT(command->mesh.positions, i0));
-        vec4f_t p1 = vecf4_as_point((vec3f_t *)ATTR_AT(command->mesh.positions, i1));
-        vec4f_t p2 = vecf4_as_point((vec3f_t *)ATTR_AT(command->mesh.positions, i2));
+fn cpu_features_t cpu_detect(void)
+{
+    cpu_features_t features = {0};
+    u32 regs[4];
+
+    cpuid(0, 0, regs);
+    u32 const max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    features.sse41 = (regs[2] >> 19) & 1;
+
+    // the os has to save the ymm registers on context switches as well
+    bool const osxsave = (regs[2] >> 27) & 1;
+    bool const avx     = (regs[2] >> 28) & 1;
+    bool const fma     = (regs[2] >> 12) & 1;
+    u64  const xcr0    = osxsave ? xgetbv(0) : 0;
+    bool const ymm     = (xcr0 & 0x6) == 0x6;
+    bool const zmm     = (xcr0 & 0xE6) == 0xE6;   // opmask and both halves of zmm0-31
+
+    if (max_leaf >= 7 && avx && ymm) {
+        cpuid(7, 0, regs);
+        features.avx2    = (regs[1] >> 5) & 1;
+        features.fma     = fma;
+        features.avx512f = zmm && ((regs[1] >> 16) & 1);
+    }
 
-        vec4f_t v0 = vec4f_mat_mul(&command->transform, &p0);
-        vec4f_t v1 = vec4f_mat_mul(&command->transform, &p1);
-        vec4f_t v2 = vec4f_mat_mul(&command->transform, &p2);
+    return features;
+}
 
-        v0 = perspective_divide(v0);
-        v1 = perspective_divide(v1);
-        v2 = perspective_divide(v2);
+/* ----------------  Pipeline -------------------- */
 
-        v0 = viewport_apply(vp, v0);
-        v1 = viewport_apply(vp, v1);
-        v2 = viewport_apply(vp, v2);
+/*
+    Colors are interpolated only when the mesh provides them and the pipeline
+    asks for it, otherwise every pixel of a triangle gets the same color
+*/
+fn inline bool pipeline_smooth(pipeline_state_t const *pipeline)
+{
+    return pipeline->interpolation == INTERPOLATION_PERSPECTIVE && (pipeline->attributes & ATTRIBUTE_COLOR);
+}
 
-        // Store original vertices for debug drawing
-        vec4f_t debug_v0 = v0;
-        vec4f_t debug_v1 = v1;
-        vec4f_t debug_v2 = v2;
+/*
+    Stencil state of a draw on a framebuffer, NULL when it has no test
+*/
+fn inline stencil_state_t const *pipeline_stencil(pipeline_state_t const *pipeline, framebuffer_t const *fb)
+{
+    return fb->stencil && pipeline->stencil.test ? &pipeline->stencil : NULL;
+}
 
-        color4_t c0 = *(color4_t *)ATTR_AT(command->mesh.colors, i0);
-        color4_t c1 = *(color4_t *)ATTR_AT(command->mesh.colors, i1);
-        color4_t c2 = *(color4_t *)ATTR_AT(command->mesh.colors, i2);
+/*
+    The depth hierarchy skips fragments that would fail the depth test, it
+    cannot when the stencil ops still have to write them
+*/
+fn inline bool stencil_writes_rejected(stencil_state_t const *stencil)
+{
+    return stencil && stencil->write_mask && (stencil->fail != STENCIL_OP_KEEP || stencil->depth_fail != STENCIL_OP_KEEP);
+}
 
-        vec4f_t v10 = vec4f_sub(&v1, &v0);
-        vec4f_t v20 = vec4f_sub(&v2, &v0);  
+/*
+    Blends whose result depends on the order of the fragments, their draws
+    have to go back to front
+*/
+fn inline bool blend_ordered(blend_mode_t blend)
+{
+    return blend == BLEND_OVER || blend == BLEND_PREMULTIPLIED;
+}
+
+/* ----------------  Primitives -------------------- */
+
+/*
+    Triangles drawn from `count` indices, or vertices, of a topology
+*/
+fn inline u32 topology_triangle_count(topology_t topology, u32 count)
+{
+    if (topology == TOPOLOGY_TRIANGLE_LIST) {
+        return count / 3;
+    }
+    return count >= 3 ? count - 2 : 0;
+}
+
+/*
+    Entry i of the index list, decoded from its stored width
+*/
+fn inline u32 mesh_index(mesh_t const *mesh, u32 i)
+{
+    switch (mesh->index_format)
+    {
+        case INDEX_FORMAT_U16: return ((u16 const *)mesh->indices)[i];
+        case INDEX_FORMAT_U8:  return ((u8  const *)mesh->indices)[i];
+        default:               return ((u32 const *)mesh->indices)[i];
+    }
+}
+
+/*
+    Indexed meshes fetch their vertices from a post-transform buffer of
+    vertex_count entries, every index has to fall inside it. Release builds
+    define NDEBUG and only check that there is a buffer, meshes are validated
+    in full when they are built, as load_obj does
+*/
+fn bool mesh_indices_valid(mesh_t const *mesh)
+{
+    if (!mesh->indices || mesh->meshlets) {
+        return true;
+    }
+
+    if (!mesh->vertex_count) {
+        return false;
+    }
+
+#ifndef NDEBUG
+    for (u32 i = 0; i < mesh->count; ++i) {
+        if (mesh_index(mesh, i) >= mesh->vertex_count) {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+/*
+    Vertices of triangle t of a mesh. Odd strip triangles swap their last two
+    vertices so the whole strip keeps the winding of the first triangle, and
+    the first vertex of every triangle is always the one flat shading uses
+*/
+fn inline void mesh_triangle(mesh_t const *mesh, u32 t, u32 out[3])
+{
+    switch (mesh->topology)
+    {
+        case TOPOLOGY_TRIANGLE_STRIP:
+            out[0] = t;
+            out[1] = t + 1 + (t & 1);
+            out[2] = t + 2 - (t & 1);
+            break;
+        case TOPOLOGY_TRIANGLE_FAN:
+            out[0] = t + 1;
+            out[1] = t + 2;
+            out[2] = 0;
+            break;
+        default:
+            out[0] = t * 3 + 0;
+            out[1] = t * 3 + 1;
+            out[2] = t * 3 + 2;
+            break;
+    }
+
+    if (mesh->indices) {
+        for (u32 i = 0; i < 3; ++i) {
+            out[i] = mesh_index(mesh, out[i]);
+        }
+    }
+}
+
+/* ----------------  Binning -------------------- */
+fn void binner_init(binner_t *b)
+{
+    omp_set_dynamic(0);
+    b->thread_count = (u32)MIN(MAX(omp_get_max_threads(), 1), MAX_RASTER_THREADS);
+}
+
+fn void binner_resize(binner_t *b, u32 width, u32 height)
+{
+    b->tiles_x    = (width  + TILE_SIZE - 1) >> TILE_SIZE_LOG2;
+    b->tiles_y    = (height + TILE_SIZE - 1) >> TILE_SIZE_LOG2;
+    b->tile_count = b->tiles_x * b->tiles_y;
+
+    for (u32 t = 0; t < b->thread_count; ++t)
+    {
+        raster_thread_t *thread = &b->threads[t];
+
+        if (thread->bins) {
+            for (u32 i = 0; i < thread->bin_count; ++i) {
+                free(thread->bins[i].items);
+            }
+            free(thread->bins);
+        }
+        thread->bins      = (tile_bin_t *)CHECK_PTR(calloc(b->tile_count, sizeof(tile_bin_t)));
+        thread->bin_count = b->tile_count;
+    }
+}
+
+fn inline void bin_push(tile_bin_t *bin, u32 item)
+{
+    if (bin->count >= bin->capacity) {
+        bin->capacity = bin->capacity ? bin->capacity * 2 : 64;
+        bin->items    = (u32 *)CHECK_PTR(realloc(bin->items, sizeof(u32) * bin->capacity));
+    }
+    bin->items[bin->count++] = item;
+}
+
+/*
+    Next free triangle of the thread's list, with room for `varying_count`
+    varying planes when the draw is programmable
+*/
+fn inline raster_tri_t *thread_push_tri(raster_thread_t *thread, u32 varying_count)
+{
+    if (thread->tri_count >= thread->tri_capacity) {
+        thread->tri_capacity = thread->tri_capacity ? thread->tri_capacity * 2 : 1024;
+        thread->tris         = (raster_tri_t *)CHECK_PTR(realloc(thread->tris, sizeof(raster_tri_t) * thread->tri_capacity));
+    }
+
+    if ((size_t)(thread->tri_count + 1) * varying_count > thread->varying_capacity)
+    {
+        thread->varying_capacity = (size_t)thread->tri_capacity * varying_count;
+        thread->varyings         = (plane_t *)CHECK_PTR(realloc(thread->varyings, sizeof(plane_t) * thread->varying_capacity));
+
+        // the planes moved, the triangles binned so far have to follow them
+        for (u32 i = 0; i < thread->tri_count; ++i) {
+            thread->tris[i].varyings = &thread->varyings[(size_t)i * varying_count];
+        }
+    }
+
+    raster_tri_t *tri = &thread->tris[thread->tri_count];
+    tri->varyings = varying_count ? &thread->varyings[(size_t)thread->tri_count * varying_count] : NULL;
+    return tri;
+}
+
+/* ----------------  Clipping -------------------- */
+
+/*
+    Guard band in normalized device coordinates, one pixel is kept as margin
+    for the offset between the viewport center and the snapping origin
+*/
+fn vec2f_t clip_guard_band(viewport_t const *vp)
+{
+    f32 const half_w = 0.5f * (f32)MAX(vp->xmax - vp->xmin, 1);
+    f32 const half_h = 0.5f * (f32)MAX(vp->ymax - vp->ymin, 1);
+
+    return (vec2f_t){
+        .x = (GUARD_BAND - 1.f) / half_w,
+        .y = (GUARD_BAND - 1.f) / half_h,
+    };
+}
+
+/*
+    Signed distance of a vertex to a clip plane, negative means outside
+*/
+fn inline f32 clip_distance(clip_plane_t plane, vec4f_t const *p, vec2f_t guard)
+{
+    switch (plane)
+    {
+        case CLIP_PLANE_W:      return p->w - CLIP_W_EPSILON;
+        case CLIP_PLANE_NEAR:   return p->z;
+        case CLIP_PLANE_FAR:    return p->w - p->z;
+        case CLIP_PLANE_LEFT:   return guard.x * p->w + p->x;
+        case CLIP_PLANE_RIGHT:  return guard.x * p->w - p->x;
+        case CLIP_PLANE_TOP:    return guard.y * p->w - p->y;
+        case CLIP_PLANE_BOTTOM: return guard.y * p->w + p->y;
+        default:                return 0.f;
+    }
+}
+
+/*
+    One bit per plane the vertex is outside of
+*/
+fn inline u32 clip_outcode(vec4f_t const *p, vec2f_t guard)
+{
+    u32 code = 0;
+
+    for (u32 plane = 0; plane < CLIP_PLANE_COUNT; ++plane) {
+        if (clip_distance((clip_plane_t)plane, p, guard) < 0.f) {
+            code |= 1u << plane;
+        }
+    }
+    return code;
+}
+
+fn inline u8 clip_lerp_u8(u8 a, u8 b, f32 t)
+{
+    return (u8)((f32)a + ((f32)b - (f32)a) * t + 0.5f);
+}
+
+/*
+    Vertex at t along a to b, its `varying_count` varyings go to `varyings`
+*/
+fn inline clip_vertex_t clip_lerp(clip_vertex_t const *a, clip_vertex_t const *b, f32 t, f32 *varyings, u32 varying_count)
+{
+    clip_vertex_t v = {
+        .position = {
+            a->position.x + (b->position.x - a->position.x) * t,
+            a->position.y + (b->position.y - a->position.y) * t,
+            a->position.z + (b->position.z - a->position.z) * t,
+            a->position.w + (b->position.w - a->position.w) * t,
+        },
+        .color = {
+            clip_lerp_u8(a->color.r, b->color.r, t),
+            clip_lerp_u8(a->color.g, b->color.g, t),
+            clip_lerp_u8(a->color.b, b->color.b, t),
+            clip_lerp_u8(a->color.a, b->color.a, t),
+        },
+    };
+
+    if (varying_count) {
+        for (u32 i = 0; i < varying_count; ++i) {
+            varyings[i] = a->varyings[i] + (b->varyings[i] - a->varyings[i]) * t;
+        }
+        v.varyings = varyings;
+    }
+    return v;
+}
+
+/*
+    Sutherland-Hodgman clipping of a triangle against the planes set in
+    `planes`, returns the vertex count of the resulting convex polygon.
+    Only the planes some vertex is outside of are ever passed in, so
+    triangles that merely cross the screen edges are never clipped. The
+    varyings of the vertices it creates are written to `lerps`.
+*/
+fn u32 clip_triangle(clip_vertex_t const in[3], clip_vertex_t out[MAX_CLIP_VERTICES], u32 planes, vec2f_t guard,
+                     f32 lerps[MAX_CLIP_LERPS][MAX_VARYINGS], u32 varying_count)
+{
+    clip_vertex_t buffer[MAX_CLIP_VERTICES];
+
+    clip_vertex_t *src = out;
+    clip_vertex_t *dst = buffer;
+
+    u32 count = 3;
+    u32 lerp  = 0;
+    src[0] = in[0];
+    src[1] = in[1];
+    src[2] = in[2];
+
+    for (u32 plane = 0; plane < CLIP_PLANE_COUNT && count; ++plane)
+    {
+        if (!(planes & (1u << plane))) {
+            continue;
+        }
+
+        u32 kept = 0;
+
+        for (u32 i = 0; i < count; ++i)
+        {
+            clip_vertex_t const *a = &src[i];
+            clip_vertex_t const *b = &src[(i + 1) % count];
+
+            f32 const da = clip_distance((clip_plane_t)plane, &a->position, guard);
+            f32 const db = clip_distance((clip_plane_t)plane, &b->position, guard);
+
+            if (da >= 0.f) {
+                dst[kept++] = *a;
+            }
+            if ((da >= 0.f) != (db >= 0.f)) {
+                dst[kept++] = clip_lerp(a, b, da / (da - db), lerps[lerp++], varying_count);
+            }
+        }
+
+        clip_vertex_t *tmp = src;
+        src   = dst;
+        dst   = tmp;
+        count = kept;
+    }
+
+    if (src != out) {
+        memcpy(out, src, sizeof(clip_vertex_t) * count);
+    }
+    return count;
+}
+
+fn inline post_vertex_t vertex_project(viewport_t const *vp, clip_vertex_t const *cv, vec2f_t guard)
+{
+    return (post_vertex_t){
+        .clip    = *cv,
+        .screen  = viewport_apply(vp, perspective_divide(cv->position)),
+        .outcode = clip_outcode(&cv->position, guard),
+    };
+}
+
+/*
+    Plane through the values a0, a1, a2 at the snapped vertices s, evaluated
+    relative to the fixed point position (ox, oy)
+*/
+fn plane_t plane_setup(vec2_t const s[3], i64 det, i32 ox, i32 oy, f32 a0, f32 a1, f32 a2)
+{
+    f64 const d1 = (f64)a1 - a0;
+    f64 const d2 = (f64)a2 - a0;
+    f64 const dx = (d1 * (s[2].y - s[0].y) - d2 * (s[1].y - s[0].y)) / (f64)det;
+    f64 const dy = (d2 * (s[1].x - s[0].x) - d1 * (s[2].x - s[0].x)) / (f64)det;
+
+    return (plane_t){
+        .origin = (f32)(a0 + dx * (ox - s[0].x) + dy * (oy - s[0].y)),
+        .dx     = (f32)(dx * SUBPIXEL_ONE),
+        .dy     = (f32)(dy * SUBPIXEL_ONE),
+    };
+}
+
+/*
+    Cull and compute the screen bounding box of one projected triangle,
+    returns false if it does not produce any pixels. Flat attributes come
+    from `provoking`, the first vertex of the triangle before any clipping
+*/
+fn bool setup_triangle(raster_tri_t *tri, framebuffer_t const *fb, draw_command_t const *command, viewport_t const *vp, post_vertex_t const *pv[3],
+                       clip_vertex_t const *provoking)
+{
+    vec4f_t v0 = pv[0]->screen;
+    vec4f_t v1 = pv[1]->screen;
+    vec4f_t v2 = pv[2]->screen;
+
+    color4_t c0 = pv[0]->clip.color;
+    color4_t c1 = pv[1]->clip.color;
+    color4_t c2 = pv[2]->clip.color;
+
+    f32 const *a0 = pv[0]->clip.varyings;
+    f32 const *a1 = pv[1]->clip.varyings;
+    f32 const *a2 = pv[2]->clip.varyings;
+
+    u32 const varying_count = command->shader ? command->shader->varying_count : 0;
+
+    // snap to fixed point relative to the viewport center, the guard band keeps
+    // the edge functions inside 32 bits for every pixel of the bounding box
+    i32 const cx = (vp->xmin + vp->xmax) / 2;
+    i32 const cy = (vp->ymin + vp->ymax) / 2;
+
+    vec4f_t const *v[3] = {&v0, &v1, &v2};
+    vec2_t s[3];
+
+    for (u32 i = 0; i < 3; ++i)
+    {
+        f32 const x = v[i]->x - (f32)cx;
+        f32 const y = v[i]->y - (f32)cy;
+
+        // clipping already keeps vertices inside the guard band, this catches
+        // rounding at its border and NaN coordinates
+        if (!(fabsf(x) <= GUARD_BAND && fabsf(y) <= GUARD_BAND)) {
+            return false;
+        }
+        s[i].x = (i32)lrintf(x * SUBPIXEL_ONE);
+        s[i].y = (i32)lrintf(y * SUBPIXEL_ONE);
+    }
+
+    i64 det012 = (i64)(s[1].x - s[0].x) * (s[2].y - s[0].y) - (i64)(s[1].y - s[0].y) * (s[2].x - s[0].x);
+
+    if (det012 == 0) {
+        return false;
+    }
+
+    // is it counter-clockwise
+    bool const ccw = det012 < 0;
+
+    switch(command->pipeline.cull_mode)
+    {
+        case CULL_MODE_NONE:
+            break;
+        case CULL_MODE_CW:
+            if(!ccw)
+                return false;
+            break;
+        case CULL_MODE_CCW:
+            if(ccw)
+                return false;
+            break;
+    }
+
+    if (ccw){
+        vecf4_swap(&v1, &v2);
+        color4_swap(&c1, &c2);
+        f32 const *a = a1;
+        a1 = a2;
+        a2 = a;
+        vec2_t const tmp = s[1];
+        s[1] = s[2];
+        s[2] = tmp;
+        det012 = -det012;
+    }
+
+    // Bounding Box, first and last pixel whose center lies inside the snapped bounds
+    i32 const half = SUBPIXEL_ONE / 2;
+
+    i32 xmin = MAX(vp->xmin, 0);
+    i32 xmax = MIN(vp->xmax, (i32)fb->color->width);
+    i32 ymin = MAX(vp->ymin, 0);
+    i32 ymax = MIN(vp->ymax, (i32)fb->color->height);
+
+    xmin = MAX(xmin, cx + ((MIN3(s[0].x, s[1].x, s[2].x) - half + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS));
+    xmax = MIN(xmax, cx + ((MAX3(s[0].x, s[1].x, s[2].x) - half) >> SUBPIXEL_BITS) + 1);
+    ymin = MAX(ymin, cy + ((MIN3(s[0].y, s[1].y, s[2].y) - half + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS));
+    ymax = MIN(ymax, cy + ((MAX3(s[0].y, s[1].y, s[2].y) - half) >> SUBPIXEL_BITS) + 1);
+
+    if (xmin >= xmax || ymin >= ymax) {
+        return false;
+    }
+
+    tri->v0     = v0;
+    tri->v1     = v1;
+    tri->v2     = v2;
+
+    // center of the first pixel of the bounding box
+    i32 const ox = ((xmin - cx) << SUBPIXEL_BITS) + half;
+    i32 const oy = ((ymin - cy) << SUBPIXEL_BITS) + half;
+
+    // edges v1->v2, v2->v0, v0->v1 give the barycentric weights of v0, v1, v2
+    u32 const ep[3] = {1, 2, 0};
+    u32 const eq[3] = {2, 0, 1};
+
+    for (u32 i = 0; i < 3; ++i)
+    {
+        vec2_t const p = s[ep[i]];
+        vec2_t const q = s[eq[i]];
+
+        i32 const a = p.y - q.y;
+        i32 const b = q.x - p.x;
+
+        // top-left rule: pixels exactly on an edge belong to it only if it is
+        // a left edge or a horizontal top edge, bias the others by one
+        bool const top_left = a > 0 || (a == 0 && b > 0);
+
+        i64 const e = (i64)a * (ox - p.x) + (i64)b * (oy - p.y) - (top_left ? 0 : 1);
+
+        // stepping happens on whole pixels, flooring keeps the sign test exact
+        tri->edge_a[i] = a;
+        tri->edge_b[i] = b;
+        tri->edge_c[i] = (i32)(e >> SUBPIXEL_BITS);
+    }
+
+    // small triangles only have a few candidate pixels, test them all now so
+    // the ones that miss every pixel center are culled before any more setup
+    tri->coverage = 0;
+
+    if (xmax - xmin <= SMALL_TRI_SIZE && ymax - ymin <= SMALL_TRI_SIZE)
+    {
+        for (i32 dy = 0; dy < ymax - ymin; ++dy) {
+            for (i32 dx = 0; dx < xmax - xmin; ++dx) {
+                i32 const e0 = tri->edge_c[0] + tri->edge_a[0] * dx + tri->edge_b[0] * dy;
+                i32 const e1 = tri->edge_c[1] + tri->edge_a[1] * dx + tri->edge_b[1] * dy;
+                i32 const e2 = tri->edge_c[2] + tri->edge_a[2] * dx + tri->edge_b[2] * dy;
+
+                if ((e0 | e1 | e2) >= 0) {
+                    tri->coverage |= 1u << (dx + dy * SMALL_TRI_SIZE);
+                }
+            }
+        }
+
+        if (!tri->coverage) {
+            return false;
+        }
+    }
+
+    // screen space depth is affine, keep it as a plane so the hierarchy can
+    // bound it over any block with the same values the pixels will get
+    tri->z     = plane_setup(s, det012, ox, oy, v0.z, v1.z, v2.z);
+
+    // varyings only depend on the interpolation mode, there are no colors to read
+    bool const smooth = command->shader ? command->pipeline.interpolation == INTERPOLATION_PERSPECTIVE
+                                        : pipeline_smooth(&command->pipeline);
+
+    if (smooth) {
+        // attributes are affine once divided by w, the pixels divide it back out
+        f32 const iw0 = 1.f / v0.w;
+        f32 const iw1 = 1.f / v1.w;
+        f32 const iw2 = 1.f / v2.w;
+
+        tri->inv_w    = plane_setup(s, det012, ox, oy, iw0, iw1, iw2);
+        tri->color[0] = plane_setup(s, det012, ox, oy, c0.r * iw0, c1.r * iw1, c2.r * iw2);
+        tri->color[1] = plane_setup(s, det012, ox, oy, c0.g * iw0, c1.g * iw1, c2.g * iw2);
+        tri->color[2] = plane_setup(s, det012, ox, oy, c0.b * iw0, c1.b * iw1, c2.b * iw2);
+
+        for (u32 i = 0; i < varying_count; ++i) {
+            tri->varyings[i] = plane_setup(s, det012, ox, oy, a0[i] * iw0, a1[i] * iw1, a2[i] * iw2);
+        }
+    } else {
+        // constant planes keep the scalar paths working. weighted oit still
+        // needs the depth of every fragment, only the attributes stay flat
+        color4_t const c = provoking->color;
+
+        tri->inv_w    = command->pipeline.blend != BLEND_WEIGHTED_OIT ? (plane_t){1.f, 0.f, 0.f} :
+                        plane_setup(s, det012, ox, oy, 1.f / v0.w, 1.f / v1.w, 1.f / v2.w);
+        tri->color[0] = (plane_t){(f32)c.r, 0.f, 0.f};
+        tri->color[1] = (plane_t){(f32)c.g, 0.f, 0.f};
+        tri->color[2] = (plane_t){(f32)c.b, 0.f, 0.f};
+
+        for (u32 i = 0; i < varying_count; ++i) {
+            tri->varyings[i] = (plane_t){provoking->varyings[i], 0.f, 0.f};
+        }
+    }
+    tri->flat_color = (u32)provoking->color.r | (u32)provoking->color.g << 8 | (u32)provoking->color.b << 16 | 0xFF000000u;
+
+    tri->z_min    = MIN3(v0.z, v1.z, v2.z);
+    tri->z_max    = MAX3(v0.z, v1.z, v2.z);
+
+    tri->xmin   = xmin;
+    tri->ymin   = ymin;
+    tri->xmax   = xmax;
+    tri->ymax   = ymax;
+
+    return true;
+}
+
+/*
+    Append the triangle just set up at the end of the thread's list to the bins
+    of the tiles it overlaps, tiles whose depth bounds hide it are skipped
+*/
+fn void bin_triangle(raster_thread_t *thread, hiz_t const *hiz, framebuffer_t const *fb, draw_command_t const *command)
+{
+    raster_tri_t const *tri = &thread->tris[thread->tri_count];
+
+    u32 const tx0 = (u32)tri->xmin >> TILE_SIZE_LOG2;
+    u32 const ty0 = (u32)tri->ymin >> TILE_SIZE_LOG2;
+    u32 const tx1 = (u32)(tri->xmax - 1) >> TILE_SIZE_LOG2;
+    u32 const ty1 = (u32)(tri->ymax - 1) >> TILE_SIZE_LOG2;
+
+    depth_bounds_t const z = hiz ? depth_bounds_quantize(fb->depth->format, tri->z_min, tri->z_max) : (depth_bounds_t){0};
+
+    u32 binned = 0;
+
+    for (u32 ty = ty0; ty <= ty1; ++ty) {
+        for (u32 tx = tx0; tx <= tx1; ++tx) {
+            u32 const tile = tx + ty * binner.tiles_x;
+
+            if (hiz && hiz_reject(command->pipeline.depth.compare, hiz->tiles[tile], z.min, z.max)) {
+                thread->stats.tiles_hiz_rejected++;
+                continue;
+            }
+            bin_push(&thread->bins[tile], thread->tri_count);
+            binned++;
+        }
+    }
+
+    if (!binned) {
+        thread->stats.tris_hiz_rejected++;
+        return;
+    }
+    thread->stats.tris_binned++;
+    thread->stats.tris_small += tri->coverage != 0;
+    thread->tri_count++;
+}
+
+/*
+    Recompute the bounds of a tile from its blocks
+*/
+fn void hiz_update_tile(hiz_t *hiz, u32 tx, u32 ty)
+{
+    u32 const per_tile = TILE_SIZE / HIZ_BLOCK_SIZE;
+
+    u32 const bx0 = tx * per_tile;
+    u32 const by0 = ty * per_tile;
+    u32 const bx1 = MIN(bx0 + per_tile, hiz->blocks_x);
+    u32 const by1 = MIN(by0 + per_tile, hiz->blocks_y);
+
+    depth_bounds_t bounds = hiz->blocks[bx0 + by0 * hiz->blocks_x];
+
+    for (u32 by = by0; by < by1; ++by) {
+        for (u32 bx = bx0; bx < bx1; ++bx) {
+            depth_bounds_t const block = hiz->blocks[bx + by * hiz->blocks_x];
+            bounds.min = MIN(bounds.min, block.min);
+            bounds.max = MAX(bounds.max, block.max);
+        }
+    }
+    hiz->tiles[tx + ty * hiz->tiles_x] = bounds;
+}
+
+fn raster_stats_t raster_stats_total(binner_t const *b)
+{
+    raster_stats_t total = {0};
+
+    for (u32 t = 0; t < b->thread_count; ++t)
+    {
+        raster_stats_t const *stats = &b->threads[t].stats;
+
+        total.draws_culled            += stats->draws_culled;
+        total.meshlets_frustum_culled += stats->meshlets_frustum_culled;
+        total.meshlets_cone_culled    += stats->meshlets_cone_culled;
+        total.tris_binned             += stats->tris_binned;
+        total.tris_small              += stats->tris_small;
+        total.tris_hiz_rejected       += stats->tris_hiz_rejected;
+        total.tiles_hiz_rejected      += stats->tiles_hiz_rejected;
+        total.blocks_edge_rejected    += stats->blocks_edge_rejected;
+        total.blocks_full             += stats->blocks_full;
+        total.blocks_tested           += stats->blocks_tested;
+        total.blocks_hiz_rejected     += stats->blocks_hiz_rejected;
+    }
+    return total;
+}
+
+fn void raster_stats_reset(binner_t *b)
+{
+    for (u32 t = 0; t < b->thread_count; ++t) {
+        b->threads[t].stats = (raster_stats_t){0};
+    }
+}
+
+/*
+    Scalar depth access for the small triangle path, values are quantized
+    like the raster kernels do it
+*/
+fn inline i32 depth_load(depth_view_t const *depth, i32 x, i32 y)
+{
+    size_t const offset = (size_t)x + (size_t)y * depth->width;
+
+    switch (depth->format)
+    {
+        case DEPTH_FORMAT_D16:  return ((u16 const *)depth->pixels)[offset];
+        case DEPTH_FORMAT_D24:  return (i32)(((u32 const *)depth->pixels)[offset] & 0xFFFFFF);
+        case DEPTH_FORMAT_D32F:
+        default:                return (i32)((u32 const *)depth->pixels)[offset];
+    }
+}
+
+fn inline void depth_store(depth_view_t const *depth, i32 x, i32 y, i32 value)
+{
+    size_t const offset = (size_t)x + (size_t)y * depth->width;
+
+    switch (depth->format)
+    {
+        case DEPTH_FORMAT_D16:{
+            ((u16 *)depth->pixels)[offset] = (u16)value;
+        }break;
+        case DEPTH_FORMAT_D24:{
+            // the upper byte is left untouched
+            u32 *dst = (u32 *)depth->pixels + offset;
+            *dst = (*dst & 0xFF000000) | (u32)value;
+        }break;
+        case DEPTH_FORMAT_D32F:{
+            ((u32 *)depth->pixels)[offset] = (u32)value;
+        }break;
+    }
+}
+
+fn inline bool depth_compare(compare_op_t op, i32 a, i32 b)
+{
+    switch (op)
+    {
+        case COMPARE_NEVER:         return false;
+        case COMPARE_LESS:          return a <  b;
+        case COMPARE_EQUAL:         return a == b;
+        case COMPARE_LESS_EQUAL:    return a <= b;
+        case COMPARE_GREATER:       return a >  b;
+        case COMPARE_NOT_EQUAL:     return a != b;
+        case COMPARE_GREATER_EQUAL: return a >= b;
+        case COMPARE_ALWAYS:
+        default:                    return true;
+    }
+}
+
+fn inline u32 stencil_op_apply(stencil_op_t op, u32 value, u32 reference)
+{
+    switch (op)
+    {
+        case STENCIL_OP_ZERO:               return 0;
+        case STENCIL_OP_REPLACE:            return reference;
+        case STENCIL_OP_INCREMENT_CLAMP:    return MIN(value + 1, 255u);
+        case STENCIL_OP_DECREMENT_CLAMP:    return value ? value - 1 : 0;
+        case STENCIL_OP_INVERT:             return ~value & 0xFF;
+        case STENCIL_OP_INCREMENT_WRAP:     return (value + 1) & 0xFF;
+        case STENCIL_OP_DECREMENT_WRAP:     return (value - 1) & 0xFF;
+        case STENCIL_OP_KEEP:
+        default:                            return value;
+    }
+}
+
+/*
+    Scalar stencil access for the small triangle and shaded paths
+*/
+fn inline bool stencil_test(stencil_state_t const *state, stencil_view_t const *stencil, i32 x, i32 y)
+{
+    u32 const stored = stencil->pixels[(size_t)x + (size_t)y * stencil->width];
+
+    return depth_compare(state->compare, state->reference & state->read_mask, (i32)(stored & state->read_mask));
+}
+
+fn inline void stencil_update(stencil_state_t const *state, stencil_view_t const *stencil, i32 x, i32 y, stencil_op_t op)
+{
+    if (op == STENCIL_OP_KEEP || !state->write_mask) {
+        return;
+    }
+
+    u8 *dst = &stencil->pixels[(size_t)x + (size_t)y * stencil->width];
+
+    u32 const value = stencil_op_apply(op, *dst, state->reference);
+    *dst = (u8)((*dst & ~state->write_mask) | (value & state->write_mask));
+}
+
+/*
+    Recompute the bounds of the block holding pixel (x, y) after a write
+*/
+fn void hiz_update_block(hiz_t *hiz, depth_view_t const *depth, i32 x, i32 y)
+{
+    i32 const bx = x & ~(HIZ_BLOCK_SIZE - 1);
+    i32 const by = y & ~(HIZ_BLOCK_SIZE - 1);
+    i32 const bw = MIN(bx + HIZ_BLOCK_SIZE, (i32)depth->width);
+    i32 const bh = MIN(by + HIZ_BLOCK_SIZE, (i32)depth->height);
+
+    depth_bounds_t bounds = {INT32_MAX, INT32_MIN};
+
+    for (i32 py = by; py < bh; ++py) {
+        for (i32 px = bx; px < bw; ++px) {
+            i32 const value = depth_load(depth, px, py);
+            bounds.min = MIN(bounds.min, value);
+            bounds.max = MAX(bounds.max, value);
+        }
+    }
+    hiz->blocks[(u32)(bx >> HIZ_BLOCK_SIZE_LOG2) + (u32)(by >> HIZ_BLOCK_SIZE_LOG2) * hiz->blocks_x] = bounds;
+}
+
+/*
+    Scalar version of the reciprocal of the raster kernels, an approximation
+    refined with one Newton-Raphson step
+*/
+fn inline f32 rcp_refined(f32 a)
+{
+    __m128 const v = _mm_set_ss(a);
+    __m128 const r = _mm_rcp_ss(v);
+    return _mm_cvtss_f32(_mm_mul_ss(r, _mm_sub_ss(_mm_set_ss(2.f), _mm_mul_ss(v, r))));
+}
+
+/*
+    Triangles with a bounding box of at most SMALL_TRI_SIZE pixels a side only
+    shade the pixels whose centers setup found inside, without any edge tests
+*/
+fn void rasterize_small_triangle(framebuffer_t const *fb, draw_command_t const *command, raster_tri_t const *tri, i32 x0, i32 y0, i32 x1, i32 y1, raster_stats_t *stats)
+{
+    (void) stats;
+
+    depth_view_t    const *depth_buf = fb->depth;
+    stencil_state_t const *stencil   = pipeline_stencil(&command->pipeline, fb);
+
+    bool const depth_test  = depth_buf && command->pipeline.depth.test;
+    bool const depth_write = depth_test && command->pipeline.depth.write;
+
+    hiz_t *hiz = depth_test ? depth_buf->hiz : NULL;
+
+    bool written = false;
+
+    for (u32 bit = 0; bit < SMALL_TRI_SIZE * SMALL_TRI_SIZE; ++bit)
+    {
+        if (!(tri->coverage & (1u << bit))) {
+            continue;
+        }
+
+        i32 const dx = (i32)(bit % SMALL_TRI_SIZE);
+        i32 const dy = (i32)(bit / SMALL_TRI_SIZE);
+        i32 const x  = tri->xmin + dx;
+        i32 const y  = tri->ymin + dy;
+
+        // the bounding box can straddle tiles
+        if (x < x0 || x >= x1 || y < y0 || y >= y1) {
+            continue;
+        }
+
+        if (stencil && !stencil_test(stencil, fb->stencil, x, y)) {
+            stencil_update(stencil, fb->stencil, x, y, stencil->fail);
+            continue;
+        }
+
+        if (depth_test)
+        {
+            i32 const z = depth_quantize(depth_buf->format, tri->z.origin + tri->z.dx * (f32)dx + tri->z.dy * (f32)dy);
+
+            if (!depth_compare(command->pipeline.depth.compare, z, depth_load(depth_buf, x, y))) {
+                if (stencil) {
+                    stencil_update(stencil, fb->stencil, x, y, stencil->depth_fail);
+                }
+                continue;
+            }
+            if (depth_write) {
+                depth_store(depth_buf, x, y, z);
+
+                if (hiz) {
+                    hiz_update_block(hiz, depth_buf, x, y);
+                    written = true;
+                }
+            }
+        }
+
+        if (stencil) {
+            stencil_update(stencil, fb->stencil, x, y, stencil->pass);
+        }
+
+        if (!pipeline_smooth(&command->pipeline)) {
+            // written as is, it can be a visibility id rather than a color
+            memcpy(&COLOR_BUF_AT(fb->color, (u32)x, (u32)y), &tri->flat_color, sizeof(u32));
+            continue;
+        }
+
+        f32 const w = rcp_refined(tri->inv_w.origin + tri->inv_w.dx * (f32)dx + tri->inv_w.dy * (f32)dy);
+
+        f32 const r = (tri->color[0].origin + tri->color[0].dx * (f32)dx + tri->color[0].dy * (f32)dy) * w;
+        f32 const g = (tri->color[1].origin + tri->color[1].dx * (f32)dx + tri->color[1].dy * (f32)dy) * w;
+        f32 const b = (tri->color[2].origin + tri->color[2].dx * (f32)dx + tri->color[2].dy * (f32)dy) * w;
+
+        COLOR_BUF_AT(fb->color, (u32)x, (u32)y) = (color4_t){
+            (u8)MAX(0, MIN(255, (i32)r)),
+            (u8)MAX(0, MIN(255, (i32)g)),
+            (u8)MAX(0, MIN(255, (i32)b)),
+            255,
+        };
+    }
+
+    if (written) {
+        hiz_update_tile(hiz, (u32)x0 >> TILE_SIZE_LOG2, (u32)y0 >> TILE_SIZE_LOG2);
+    }
+}
+
+/*
+    Transform up to VERTEX_BATCH positions starting at `first`
+*/
+typedef void (*transform_fn_t)(mat4x4_t const *m, attribute_t positions, u32 const *indices, u32 first, u32 count, vertex_batch_t *out);
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define TARGET_AVX512   __attribute__((target("avx512f")))
+    #define TARGET_AVX2     __attribute__((target("avx2,fma")))
+    #define TARGET_SSE41    __attribute__((target("sse4.1")))
+    #define FORCE_INLINE    inline __attribute__((always_inline))
+#else
+    #define TARGET_AVX512
+    #define TARGET_AVX2
+    #define TARGET_SSE41
+    #define FORCE_INLINE    __forceinline
+#endif
+
+/*
+    Pipeline states that get their own raster kernel, as (depth test, depth
+    write, compare, depth format, smooth). Any other state uses the generic
+    kernel. pipeline_variant computes the position of a state in this list
+*/
+#define RASTER_VARIANTS_SHADE(X, test, write, compare, format) \
+    X(test, write, compare, format, 0)                         \
+    X(test, write, compare, format, 1)
+
+#define RASTER_VARIANTS_FORMAT(X, write, compare)              \
+    RASTER_VARIANTS_SHADE(X, 1, write, compare, D16)           \
+    RASTER_VARIANTS_SHADE(X, 1, write, compare, D24)           \
+    RASTER_VARIANTS_SHADE(X, 1, write, compare, D32F)
+
+#define RASTER_VARIANTS_COMPARE(X, write)                      \
+    RASTER_VARIANTS_FORMAT(X, write, LESS)                     \
+    RASTER_VARIANTS_FORMAT(X, write, LESS_EQUAL)               \
+    RASTER_VARIANTS_FORMAT(X, write, GREATER)                  \
+    RASTER_VARIANTS_FORMAT(X, write, GREATER_EQUAL)
+
+#define RASTER_VARIANTS(X)                                     \
+    RASTER_VARIANTS_SHADE(X, 0, 0, ALWAYS, D32F)               \
+    RASTER_VARIANTS_COMPARE(X, 0)                              \
+    RASTER_VARIANTS_COMPARE(X, 1)
+
+#define RASTER_VARIANT_COUNT    (2 + 2 * 4 * 3 * 2)
+
+#define RASTER_LANES    8
+#define RASTER_NAME     rasterize_triangle_avx2
+#define RASTER_TARGET   TARGET_AVX2
+#include "./include/raster_kernel.h"
+
+#define RASTER_LANES    4
+#define RASTER_NAME     rasterize_triangle_sse41
+#define RASTER_TARGET   TARGET_SSE41
+#include "./include/raster_kernel.h"
+
+#define TRANSFORM_LANES     16
+#define TRANSFORM_NAME      transform_positions_avx512
+#define TRANSFORM_TARGET    TARGET_AVX512
+#include "./include/transform_kernel.h"
+
+#define TRANSFORM_LANES     8
+#define TRANSFORM_NAME      transform_positions_avx2
+#define TRANSFORM_TARGET    TARGET_AVX2
+#include "./include/transform_kernel.h"
+
+#define TRANSFORM_LANES     4
+#define TRANSFORM_NAME      transform_positions_sse41
+#define TRANSFORM_TARGET    TARGET_SSE41
+#include "./include/transform_kernel.h"
+
+/* ----------------  Shaders -------------------- */
+
+/*
+    Plane evaluated at the four lanes of a quad, fx and fy are their offsets
+    from the plane origin
+*/
+fn inline __m128 quad_plane(plane_t const *p, __m128 fx, __m128 fy)
+{
+    return _mm_add_ps(_mm_set1_ps(p->origin), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p->dx), fx), _mm_mul_ps(_mm_set1_ps(p->dy), fy)));
+}
+
+/*
+    Fragment colors of a quad from 0 to 1 to packed pixels, the saturating
+    packs clamp them
+*/
+fn inline __m128i quad_pack(f32 const color[4][4])
+{
+    __m128 const scale = _mm_set1_ps(255.f);
+
+    __m128i const r = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(color[0]), scale));
+    __m128i const g = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(color[1]), scale));
+    __m128i const b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(color[2]), scale));
+    __m128i const a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(color[3]), scale));
+
+    // r0..r3 g0..g3 b0..b3 a0..a3 as bytes, then interleaved per lane
+    __m128i const planar = _mm_packus_epi16(_mm_packs_epi32(r, g), _mm_packs_epi32(b, a));
+    __m128i const ba     = _mm_srli_si128(planar, 8);
+    __m128i const rg     = _mm_unpacklo_epi8(planar, _mm_srli_si128(planar, 4));
+    __m128i const ba2    = _mm_unpacklo_epi8(ba, _mm_srli_si128(ba, 4));
+
+    return _mm_unpacklo_epi16(rg, ba2);
+}
+
+/*
+    Screen space derivatives of a value given per lane of a quad, the
+    difference along the row or the column of each lane. Helper lanes are
+    interpolated, so they exist for every lane shaded
+*/
+fn inline __m128 quad_ddx(__m128 v)
+{
+    return _mm_sub_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 1, 1)), _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 0, 0)));
+}
+
+fn inline __m128 quad_ddy(__m128 v)
+{
+    return _mm_sub_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 2, 3, 2)), _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 1, 0)));
+}
+
+fn inline __m128 quad_varying(shader_quad_t const *quad, u32 varying)
+{
+    return _mm_loadu_ps(quad->varyings[varying]);
+}
+
+/*
+    Blend the fragment colors of a quad with the packed pixels under it, in
+    place. Alpha is always composited over the stored one
+*/
+fn inline void quad_blend(blend_mode_t blend, f32 color[4][4], u32 const pixels[4])
+{
+    __m128i       dst   = _mm_loadu_si128((__m128i const *)pixels);
+    __m128  const one   = _mm_set1_ps(1.f);
+    __m128  const alpha = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(color[3]), _mm_setzero_ps()), one);
+
+    __m128 const src_factor = blend == BLEND_PREMULTIPLIED ? one : alpha;
+    __m128 const dst_factor = blend == BLEND_ADDITIVE      ? one : _mm_sub_ps(one, alpha);
+
+    for (u32 c = 0; c < 4; ++c)
+    {
+        __m128 const d  = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(dst, _mm_set1_epi32(0xFF))), _mm_set1_ps(1.f / 255.f));
+        __m128 const sf = c == 3 ? one : src_factor;
+
+        _mm_storeu_ps(color[c], _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(color[c]), sf), _mm_mul_ps(d, dst_factor)));
+
+        dst = _mm_srli_epi32(dst, 8);
+    }
+}
+
+/*
+    Weight of translucent fragments from the depth based function of McGuire
+    and Bavoil, near fragments dominate far ones of the same alpha. distance
+    is the view depth, 0 at the near plane and 1 at the far one
+*/
+fn inline __m128 oit_weight(__m128 alpha, __m128 distance)
+{
+    __m128 const n = _mm_sub_ps(_mm_set1_ps(1.f), distance);
+    __m128 const w = _mm_mul_ps(_mm_set1_ps(3e3f), _mm_mul_ps(n, _mm_mul_ps(n, n)));
+
+    return _mm_mul_ps(alpha, _mm_min_ps(_mm_max_ps(w, _mm_set1_ps(1e-2f)), _mm_set1_ps(3e3f)));
+}
+
+/*
+    Add the covered lanes of a shaded quad to the oit buffers, w is the view
+    depth of each lane. The depth buffer values crowd against one end of the
+    range under a perspective projection, so they would weight every surface
+    the same
+*/
+fn inline void oit_accumulate(oit_t *oit, shader_quad_t const *quad, f32 const color[4][4], __m128 w)
+{
+    __m128 const one   = _mm_set1_ps(1.f);
+    __m128 const alpha = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(color[3]), _mm_setzero_ps()), one);
+
+    f32 const range = oit->view_far - oit->view_near;
+
+    __m128 const view     = range > 0.f ? _mm_mul_ps(_mm_sub_ps(w, _mm_set1_ps(oit->view_near)), _mm_set1_ps(1.f / range)) : _mm_setzero_ps();
+    __m128 const distance = _mm_min_ps(_mm_max_ps(view, _mm_setzero_ps()), one);
+    __m128 const weight   = oit_weight(alpha, distance);
+
+    // premultiplied and weighted, then one register per lane
+    __m128 r = _mm_mul_ps(_mm_loadu_ps(color[0]), weight);
+    __m128 g = _mm_mul_ps(_mm_loadu_ps(color[1]), weight);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(color[2]), weight);
+    __m128 a = weight;
+
+    _MM_TRANSPOSE4_PS(r, g, b, a);
+
+    __m128 const lanes[4] = {r, g, b, a};
+
+    f32 transmit[4];
+    _mm_storeu_ps(transmit, _mm_sub_ps(one, alpha));
+
+    for (u32 lane = 0; lane < 4; ++lane)
+    {
+        if (!(quad->mask & (1u << lane))) {
+            continue;
+        }
+
+        size_t const i = (size_t)(quad->x + (i32)(lane & 1)) + (size_t)(quad->y + (i32)(lane >> 1)) * oit->width;
+
+        _mm_storeu_ps(&oit->accum[i * 4], _mm_add_ps(_mm_loadu_ps(&oit->accum[i * 4]), lanes[lane]));
+        oit->revealage[i] *= transmit[lane];
+    }
+}
+
+/*
+    Rasterize the part of a programmable triangle inside [x0,x1) x [y0,y1).
+    Blocks are walked and rejected like the raster kernels do it, inside them
+    every 2x2 quad with a covered pixel that passes the depth test is shaded
+    in one call, its four lanes one SSE register. Fragment shaders cannot
+    discard, so stencil and depth are tested and written before shading.
+    Translucent draws of the oit buffers only test depth
+*/
+fn FORCE_INLINE void shade_triangle(framebuffer_t const *fb, draw_command_t const *command, raster_tri_t const *tri,
+                                    i32 x0, i32 y0, i32 x1, i32 y1, raster_stats_t *stats,
+                                    fragment_shader_fn_t fragment, u32 varying_count)
+{
+    image_view_t const *color_buf = fb->color;
+    depth_view_t const *depth_buf = fb->depth;
+
+    blend_mode_t const blend       = command->pipeline.blend == BLEND_WEIGHTED_OIT && !fb->oit ? BLEND_OVER : command->pipeline.blend;
+    compare_op_t const compare     = command->pipeline.depth.compare;
+    bool const         depth_test  = depth_buf && command->pipeline.depth.test;
+    bool const         depth_write = depth_test && command->pipeline.depth.write && blend != BLEND_WEIGHTED_OIT;
+
+    // flat varyings are constant planes, they are not divided by w
+    bool const         perspective = command->pipeline.interpolation == INTERPOLATION_PERSPECTIVE;
+
+    stencil_state_t const *stencil = pipeline_stencil(&command->pipeline, fb);
+
+    hiz_t *hiz = depth_test ? depth_buf->hiz : NULL;
+    bool const hiz_cull = hiz && !stencil_writes_rejected(stencil);
+
+    i32 const xmin = MAX(x0, tri->xmin);
+    i32 const xmax = MIN(x1, tri->xmax);
+    i32 const ymin = MAX(y0, tri->ymin);
+    i32 const ymax = MIN(y1, tri->ymax);
+
+    // lane i of a quad is at (i & 1, i >> 1)
+    __m128i const lane0 = _mm_setr_epi32(0, tri->edge_a[0], tri->edge_b[0], tri->edge_a[0] + tri->edge_b[0]);
+    __m128i const lane1 = _mm_setr_epi32(0, tri->edge_a[1], tri->edge_b[1], tri->edge_a[1] + tri->edge_b[1]);
+    __m128i const lane2 = _mm_setr_epi32(0, tri->edge_a[2], tri->edge_b[2], tri->edge_a[2] + tri->edge_b[2]);
+
+    __m128i const step0 = _mm_set1_epi32(tri->edge_a[0] * 2);
+    __m128i const step1 = _mm_set1_epi32(tri->edge_a[1] * 2);
+    __m128i const step2 = _mm_set1_epi32(tri->edge_a[2] * 2);
+
+    __m128 const lane_x = _mm_setr_ps(0.f, 1.f, 0.f, 1.f);
+    __m128 const lane_y = _mm_setr_ps(0.f, 0.f, 1.f, 1.f);
+
+    shader_quad_t quad;
+    f32 color[4][4];
+
+    bool tile_written = false;
+
+    for (i32 by = ymin & ~(HIZ_BLOCK_SIZE - 1); by < ymax; by += HIZ_BLOCK_SIZE)
+    {
+        i32 const bymin = MAX(by, ymin);
+        i32 const bymax = MIN(by + HIZ_BLOCK_SIZE, ymax);
+
+        for (i32 bx = xmin & ~(HIZ_BLOCK_SIZE - 1); bx < xmax; bx += HIZ_BLOCK_SIZE)
+        {
+            i32 const bxmin = MAX(bx, xmin);
+            i32 const bxmax = MIN(bx + HIZ_BLOCK_SIZE, xmax);
+
+            bool empty = false;
+
+            for (u32 i = 0; i < 3; ++i)
+            {
+                i32 const e  = tri->edge_c[i] + tri->edge_a[i] * (bxmin - tri->xmin) + tri->edge_b[i] * (bymin - tri->ymin);
+                i32 const ex = tri->edge_a[i] * (bxmax - 1 - bxmin);
+                i32 const ey = tri->edge_b[i] * (bymax - 1 - bymin);
+
+                empty = empty || e + MAX(ex, 0) + MAX(ey, 0) < 0;
+            }
+
+            if (empty) {
+                stats->blocks_edge_rejected++;
+                continue;
+            }
+
+            if (hiz_cull)
+            {
+                stats->blocks_tested++;
+
+                f32 const z  = tri->z.origin + tri->z.dx * (f32)(bxmin - tri->xmin) + tri->z.dy * (f32)(bymin - tri->ymin);
+                f32 const ex = tri->z.dx * (f32)(bxmax - 1 - bxmin);
+                f32 const ey = tri->z.dy * (f32)(bymax - 1 - bymin);
+
+                f32 const zlo = MAX(z + MIN(ex, 0.f) + MIN(ey, 0.f), tri->z_min);
+                f32 const zhi = MIN(z + MAX(ex, 0.f) + MAX(ey, 0.f), tri->z_max);
+
+                depth_bounds_t const q = depth_bounds_quantize(depth_buf->format, zlo, zhi);
+                depth_bounds_t const stored = hiz->blocks[(u32)(bx >> HIZ_BLOCK_SIZE_LOG2) + (u32)(by >> HIZ_BLOCK_SIZE_LOG2) * hiz->blocks_x];
+
+                if (hiz_reject(compare, stored, q.min, q.max)) {
+                    stats->blocks_hiz_rejected++;
+                    continue;
+                }
+            }
+
+            bool written = false;
+
+            // quads are aligned to even pixels, blocks hold a whole number of them
+            for (quad.y = bymin & ~1; quad.y < bymax; quad.y += 2)
+            {
+                i32 const xstart = bxmin & ~1;
+                i32 const dy     = quad.y - tri->ymin;
+
+                // rows of the quad inside the clipped block
+                u32 const rows = (quad.y >= bymin ? 0x3u : 0u) | (quad.y + 1 < bymax ? 0xCu : 0u);
+
+                __m128i e0 = _mm_add_epi32(_mm_set1_epi32(tri->edge_c[0] + tri->edge_a[0] * (xstart - tri->xmin) + tri->edge_b[0] * dy), lane0);
+                __m128i e1 = _mm_add_epi32(_mm_set1_epi32(tri->edge_c[1] + tri->edge_a[1] * (xstart - tri->xmin) + tri->edge_b[1] * dy), lane1);
+                __m128i e2 = _mm_add_epi32(_mm_set1_epi32(tri->edge_c[2] + tri->edge_a[2] * (xstart - tri->xmin) + tri->edge_b[2] * dy), lane2);
+
+                __m128 const fy = _mm_add_ps(_mm_set1_ps((f32)dy), lane_y);
+
+                for (quad.x = xstart; quad.x < bxmax; quad.x += 2)
+                {
+                    i32 const dx = quad.x - tri->xmin;
+
+                    u32 const cols = (quad.x >= bxmin ? 0x5u : 0u) | (quad.x + 1 < bxmax ? 0xAu : 0u);
+
+                    // a lane is covered when none of the edge functions has its sign bit set
+                    __m128i const e = _mm_or_si128(_mm_or_si128(e0, e1), e2);
+
+                    quad.mask = ~(u32)_mm_movemask_ps(_mm_castsi128_ps(e)) & rows & cols;
+
+                    e0 = _mm_add_epi32(e0, step0);
+                    e1 = _mm_add_epi32(e1, step1);
+                    e2 = _mm_add_epi32(e2, step2);
+
+                    if (!quad.mask) {
+                        continue;
+                    }
+
+                    __m128 const fx = _mm_add_ps(_mm_set1_ps((f32)dx), lane_x);
+
+                    if (depth_test || stencil)
+                    {
+                        f32 z[4];
+                        _mm_storeu_ps(z, quad_plane(&tri->z, fx, fy));
+
+                        for (u32 lane = 0; lane < 4; ++lane)
+                        {
+                            if (!(quad.mask & (1u << lane))) {
+                                continue;
+                            }
+
+                            i32 const x = quad.x + (i32)(lane & 1);
+                            i32 const y = quad.y + (i32)(lane >> 1);
+
+                            if (stencil && !stencil_test(stencil, fb->stencil, x, y)) {
+                                stencil_update(stencil, fb->stencil, x, y, stencil->fail);
+                                quad.mask &= ~(1u << lane);
+                                continue;
+                            }
+
+                            if (depth_test)
+                            {
+                                i32 const q = depth_quantize(depth_buf->format, z[lane]);
+
+                                if (!depth_compare(compare, q, depth_load(depth_buf, x, y))) {
+                                    if (stencil) {
+                                        stencil_update(stencil, fb->stencil, x, y, stencil->depth_fail);
+                                    }
+                                    quad.mask &= ~(1u << lane);
+                                    continue;
+                                }
+                                if (depth_write) {
+                                    depth_store(depth_buf, x, y, q);
+                                    written = true;
+                                }
+                            }
+
+                            if (stencil) {
+                                stencil_update(stencil, fb->stencil, x, y, stencil->pass);
+                            }
+                        }
+
+                        if (!quad.mask) {
+                            continue;
+                        }
+                    }
+
+                    // helper lanes outside the triangle are interpolated too, so
+                    // derivatives exist along its edges
+                    __m128 const w = _mm_div_ps(_mm_set1_ps(1.f), quad_plane(&tri->inv_w, fx, fy));
+
+                    for (u32 v = 0; v < varying_count; ++v) {
+                        __m128 const value = quad_plane(&tri->varyings[v], fx, fy);
+                        _mm_storeu_ps(quad.varyings[v], perspective ? _mm_mul_ps(value, w) : value);
+                    }
+
+                    fragment(command->uniforms, &quad, color);
+
+                    // the 1/w plane is set up for every oit draw, flat ones included
+                    if (blend == BLEND_WEIGHTED_OIT) {
+                        oit_accumulate(fb->oit, &quad, color, w);
+                        continue;
+                    }
+
+                    // opaque draws write opaque pixels, as the fixed-function kernels do
+                    if (blend == BLEND_NONE) {
+                        _mm_storeu_ps(color[3], _mm_set1_ps(1.f));
+                    }
+
+                    u32 pixels[4] = {0};
+
+                    if (blend != BLEND_NONE)
+                    {
+                        for (u32 lane = 0; lane < 4; ++lane)
+                        {
+                            if (quad.mask & (1u << lane)) {
+                                memcpy(&pixels[lane], &COLOR_BUF_AT(color_buf, (u32)(quad.x + (i32)(lane & 1)), (u32)(quad.y + (i32)(lane >> 1))), sizeof(u32));
+                            }
+                        }
+                        quad_blend(blend, color, pixels);
+                    }
+
+                    _mm_storeu_si128((__m128i *)pixels, quad_pack(color));
+
+                    for (u32 lane = 0; lane < 4; ++lane)
+                    {
+                        if (quad.mask & (1u << lane)) {
+                            memcpy(&COLOR_BUF_AT(color_buf, (u32)(quad.x + (i32)(lane & 1)), (u32)(quad.y + (i32)(lane >> 1))), &pixels[lane], sizeof(u32));
+                        }
+                    }
+                }
+            }
+
+            if (hiz && written) {
+                hiz_update_block(hiz, depth_buf, bx, by);
+                tile_written = true;
+            }
+        }
+    }
+
+    if (tile_written) {
+        hiz_update_tile(hiz, (u32)x0 >> TILE_SIZE_LOG2, (u32)y0 >> TILE_SIZE_LOG2);
+    }
+}
+
+/*
+    Kernel of the shaders without their own, both stages are called through
+    the shader
+*/
+fn void rasterize_shaded(framebuffer_t const *fb, draw_command_t const *command, raster_tri_t const *tri, i32 x0, i32 y0, i32 x1, i32 y1, raster_stats_t *stats)
+{
+    shade_triangle(fb, command, tri, x0, y0, x1, y1, stats, command->shader->fragment, command->shader->varying_count);
+}
+
+/*
+    Kernel of a built-in shader, the fragment stage is a direct call the
+    compiler inlines and the varying count is a constant
+*/
+#define SHADER_KERNEL(name, fragment, varying_count)                                                                    \
+    fn void rasterize_##name(framebuffer_t const *fb, draw_command_t const *command, raster_tri_t const *tri,           \
+                             i32 x0, i32 y0, i32 x1, i32 y1, raster_stats_t *stats)                                    \
+    {                                                                                                                   \
+        shade_triangle(fb, command, tri, x0, y0, x1, y1, stats, fragment, varying_count);                               \
+    }
+
+/* ----------------  Textures -------------------- */
+
+// spread the low 16 bits of v over the even bits
+fn inline u32 morton_spread(u32 v)
+{
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+/*
+    Position of (x, y) in a grid of texels or blocks, the coordinates are
+    interleaved up to the size of the shorter side and the rest of the longer
+    one sits above them
+*/
+fn inline u32 morton_offset(u32 width_log2, u32 height_log2, u32 x, u32 y)
+{
+    u32 const s    = MIN(width_log2, height_log2);
+    u32 const mask = (1u << s) - 1;
+
+    return morton_spread(x & mask) | morton_spread(y & mask) << 1 | ((x | y) >> s) << (2 * s);
+}
+
+fn inline u32 texel_offset(texture_level_t const *level, u32 x, u32 y)
+{
+    return morton_offset(level->width_log2, level->height_log2, x, y);
+}
+
+fn inline u32 log2_ceil(u32 v)
+{
+    u32 log = 0;
+
+    while ((1u << log) < v) {
+        log++;
+    }
+    return log;
+}
+
+/*
+    Every level from the one above it with a 2x2 box filter. In Morton order
+    the texels under one texel of the next level are consecutive, so a level
+    is a single pass over groups of four, four groups per iteration. Once a
+    side is down to one texel the groups are pairs
+*/
+fn void texture_build_mips(texture_t *texture)
+{
+    __m128i const zero  = _mm_setzero_si128();
+    __m128i const round = _mm_set1_epi16(2);
+
+    for (u32 l = 1; l < texture->level_count; ++l)
+    {
+        texture_level_t const *src = &texture->levels[l - 1];
+        texture_level_t const *dst = &texture->levels[l];
+
+        u32 const count = 1u << (dst->width_log2 + dst->height_log2);
+
+        if (!src->width_log2 || !src->height_log2)
+        {
+            for (u32 i = 0; i < count; ++i) {
+                color4_t const a = src->texels[2 * i];
+                color4_t const b = src->texels[2 * i + 1];
+
+                dst->texels[i] = (color4_t){
+                    (u8)((a.r + b.r + 1) >> 1),
+                    (u8)((a.g + b.g + 1) >> 1),
+                    (u8)((a.b + b.b + 1) >> 1),
+                    (u8)((a.a + b.a + 1) >> 1),
+                };
+            }
+            continue;
+        }
+
+        u32 i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i sums[4];
+
+            for (u32 g = 0; g < 4; ++g)
+            {
+                __m128i const group = _mm_loadu_si128((__m128i const *)&src->texels[(i + g) * 4]);
+
+                // texels 0 + 2 and 1 + 3 as 16 bit channels, then the two halves
+                __m128i const pairs = _mm_add_epi16(_mm_unpacklo_epi8(group, zero), _mm_unpackhi_epi8(group, zero));
+
+                sums[g] = _mm_add_epi16(pairs, _mm_srli_si128(pairs, 8));
+            }
+
+            __m128i const lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sums[0], sums[1]), round), 2);
+            __m128i const hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sums[2], sums[3]), round), 2);
+
+            _mm_storeu_si128((__m128i *)&dst->texels[i], _mm_packus_epi16(lo, hi));
+        }
+
+        for (; i < count; ++i)
+        {
+            color4_t const *t = &src->texels[i * 4];
+
+            dst->texels[i] = (color4_t){
+                (u8)((t[0].r + t[1].r + t[2].r + t[3].r + 2) >> 2),
+                (u8)((t[0].g + t[1].g + t[2].g + t[3].g + 2) >> 2),
+                (u8)((t[0].b + t[1].b + t[2].b + t[3].b + 2) >> 2),
+                (u8)((t[0].a + t[1].a + t[2].a + t[3].a + 2) >> 2),
+            };
+        }
+    }
+}
+
+/*
+    Texture with a full mip chain from row-major pixels, sizes that are not
+    powers of two are rounded up and resampled to the nearest pixel
+*/
+fn texture_t *texture_create(color4_t const *pixels, u32 width, u32 height)
+{
+    u32 const width_log2  = MIN(log2_ceil(width),  MAX_TEXTURE_LEVELS - 1);
+    u32 const height_log2 = MIN(log2_ceil(height), MAX_TEXTURE_LEVELS - 1);
+
+    texture_t *texture = (texture_t *)CHECK_PTR(calloc(1, sizeof(texture_t)));
+
+    texture->width       = 1u << width_log2;
+    texture->height      = 1u << height_log2;
+    texture->level_count = MAX(width_log2, height_log2) + 1;
+
+    size_t total = 0;
+
+    for (u32 l = 0; l < texture->level_count; ++l) {
+        total += (size_t)1 << (MAX(width_log2, l) - l + MAX(height_log2, l) - l);
+    }
+
+    texture->data = CHECK_PTR(malloc(sizeof(color4_t) * total));
+
+    color4_t *texels = (color4_t *)texture->data;
+
+    for (u32 l = 0; l < texture->level_count; ++l)
+    {
+        texture_level_t *level = &texture->levels[l];
+
+        level->texels      = texels;
+        level->width_log2  = MAX(width_log2, l) - l;
+        level->height_log2 = MAX(height_log2, l) - l;
+
+        texels += (size_t)1 << (level->width_log2 + level->height_log2);
+    }
+
+    texture_level_t const *top = &texture->levels[0];
+
+    for (u32 y = 0; y < texture->height; ++y) {
+        for (u32 x = 0; x < texture->width; ++x) {
+            u32 const sx = (u32)(((u64)x * width)  >> width_log2);
+            u32 const sy = (u32)(((u64)y * height) >> height_log2);
+
+            top->texels[texel_offset(top, x, y)] = pixels[sx + (size_t)sy * width];
+        }
+    }
+
+    texture_build_mips(texture);
+    return texture;
+}
+
+fn texture_t *texture_load(char const *path)
+{
+    int width, height, n;
+    unsigned char *pixels = stbi_load(path, &width, &height, &n, STBI_rgb_alpha);
+
+    if (pixels == NULL) {
+        fprintf(stdout, "Couldnt load texture : %s because :  %s\n", path, stbi_failure_reason());
+        return NULL;
+    }
+
+    texture_t *texture = texture_create((color4_t const *)pixels, (u32)width, (u32)height);
+
+    stbi_image_free(pixels);
+    return texture;
+}
+
+fn void texture_free(texture_t *texture)
+{
+    if (texture) {
+        free(texture->data);
+        free(texture);
+
+        // a later texture can reuse the addresses of its blocks
+        memset(texture_caches, 0, sizeof(texture_caches));
+    }
+}
+
+/* ----------------  Block compression -------------------- */
+
+/*
+    Modes of a BC7 block, the mode is the number of zero bits before the first
+    set one. Colors, then alpha, are stored as every endpoint of every subset
+    one channel after the other
+*/
+typedef struct bc7_mode_t
+{
+    u8  subsets;
+    u8  partition_bits;
+    u8  rotation_bits;          // alpha swapped with a color channel after decoding
+    u8  selector_bits;          // which of the two index sets the colors use
+    u8  color_bits;
+    u8  alpha_bits;             // 0 when the block is opaque
+    u8  endpoint_pbits;         // a low bit of its own for every endpoint
+    u8  shared_pbits;           // a low bit shared by the two endpoints of a subset
+    u8  index_bits;
+    u8  index2_bits;            // separate alpha indices
+}bc7_mode_t;
+
+global_variable bc7_mode_t const bc7_modes[8] =
+{
+    {3, 4, 0, 0, 4, 0, 1, 0, 3, 0},
+    {2, 6, 0, 0, 6, 0, 0, 1, 3, 0},
+    {3, 6, 0, 0, 5, 0, 0, 0, 2, 0},
+    {2, 6, 0, 0, 7, 0, 1, 0, 2, 0},
+    {1, 0, 2, 1, 5, 6, 0, 0, 2, 3},
+    {1, 0, 2, 0, 7, 8, 0, 0, 2, 2},
+    {1, 0, 0, 0, 7, 7, 1, 0, 4, 0},
+    {2, 6, 0, 0, 5, 5, 1, 0, 2, 0},
+};
+
+// subset of each pixel, a bit each for two subsets and two bits each for three
+global_variable u16 const bc7_partitions2[64] =
+{
+    0xCCCC, 0x8888, 0xEEEE, 0xECC8, 0xC880, 0xFEEC, 0xFEC8, 0xEC80, 0xC800, 0xFFEC, 0xFE80, 0xE800, 0xFFE8, 0xFF00, 0xFFF0, 0xF000,
+    0xF710, 0x008E, 0x7100, 0x08CE, 0x008C, 0x7310, 0x3100, 0x8CCE, 0x088C, 0x3110, 0x6666, 0x366C, 0x17E8, 0x0FF0, 0x718E, 0x399C,
+    0xAAAA, 0xF0F0, 0x5A5A, 0x33CC, 0x3C3C, 0x55AA, 0x9696, 0xA55A, 0x73CE, 0x13C8, 0x324C, 0x3BDC, 0x6996, 0xC33C, 0x9966, 0x0660,
+    0x0272, 0x04E4, 0x4E40, 0x2720, 0xC936, 0x936C, 0x39C6, 0x639C, 0x9336, 0x9CC6, 0x817E, 0xE718, 0xCCF0, 0x0FCC, 0x7744, 0xEE22,
+};
+
+global_variable u32 const bc7_partitions3[64] =
+{
+    0xAA685050, 0x6A5A5040, 0x5A5A4200, 0x5450A0A8, 0xA5A50000, 0xA0A05050, 0x5555A0A0, 0x5A5A5050,
+    0xAA550000, 0xAA555500, 0xAAAA5500, 0x90909090, 0x94949494, 0xA4A4A4A4, 0xA9A59450, 0x2A0A4250,
+    0xA5945040, 0x0A425054, 0xA5A5A500, 0x55A0A0A0, 0xA8A85454, 0x6A6A4040, 0xA4A45000, 0x1A1A0500,
+    0x0050A4A4, 0xAAA59090, 0x14696914, 0x69691400, 0xA08585A0, 0xAA821414, 0x50A4A450, 0x6A5A0200,
+    0xA9A58000, 0x5090A0A8, 0xA8A09050, 0x24242424, 0x00AA5500, 0x24924924, 0x24499224, 0x50A50A50,
+    0x500AA550, 0xAAAA4444, 0x66660000, 0xA5A0A5A0, 0x50A050A0, 0x69286928, 0x44AAAA44, 0x66666600,
+    0xAA444444, 0x54A854A8, 0x95809580, 0x96969600, 0xA85454A8, 0x80959580, 0xAA141414, 0x96960000,
+    0xAAAA1414, 0xA05050A0, 0xA0A5A5A0, 0x96000000, 0x40804080, 0xA9A8A9A8, 0xAAAAAA44, 0x2A4A5254,
+};
+
+// pixel of each subset past the first whose index has its top bit implied zero
+global_variable u8 const bc7_anchors2[64] =
+{
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+    15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+     6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15,
+};
+
+global_variable u8 const bc7_anchors3[2][64] =
+{
+    {
+         3,  3, 15, 15,  8,  3, 15, 15,  8,  8,  6,  6,  6,  5,  3,  3,
+         3,  3,  8, 15,  3,  3,  6, 10,  5,  8,  8,  6,  8,  5, 15, 15,
+         8, 15,  3,  5,  6, 10,  8, 15, 15,  3, 15,  5, 15, 15, 15, 15,
+         3, 15,  5,  5,  5,  8,  5, 10,  5, 10,  8, 13, 15, 12,  3,  3,
+    },
+    {
+        15,  8,  8,  3, 15, 15,  3,  8, 15, 15, 15, 15, 15, 15, 15,  8,
+        15,  8, 15,  3, 15,  8, 15,  8,  3, 15,  6, 10, 15, 15, 10,  8,
+        15,  3, 15, 10, 10,  8,  9, 10,  6, 15,  8, 15,  3,  6,  6,  8,
+        15,  3, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  3, 15, 15,  8,
+    },
+};
+
+// interpolation weights out of 64 for 2, 3 and 4 bit indices
+global_variable u8 const bc7_weights2[4]  = {0, 21, 43, 64};
+global_variable u8 const bc7_weights3[8]  = {0, 9, 18, 27, 37, 46, 55, 64};
+global_variable u8 const bc7_weights4[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+fn inline u32 bits_read(u8 const *data, u32 *pos, u32 count)
+{
+    u32 value = 0;
+
+    for (u32 i = 0; i < count; ++i, ++*pos) {
+        value |= (u32)((data[*pos >> 3] >> (*pos & 7)) & 1) << i;
+    }
+    return value;
+}
+
+fn inline void bits_write(u8 *data, u32 *pos, u32 count, u32 value)
+{
+    for (u32 i = 0; i < count; ++i, ++*pos) {
+        data[*pos >> 3] |= (u8)(((value >> i) & 1) << (*pos & 7));
+    }
+}
+
+fn inline u8 bc7_interpolate(u32 e0, u32 e1, u32 index, u32 bits)
+{
+    u32 const w = bits == 2 ? bc7_weights2[index] : bits == 3 ? bc7_weights3[index] : bc7_weights4[index];
+
+    return (u8)(((64 - w) * e0 + w * e1 + 32) >> 6);
+}
+
+// a value of `bits` bits to 8 bits, the top bits are repeated below it
+fn inline u32 bits_expand(u32 value, u32 bits)
+{
+    return bits >= 8 ? value : (value << (8 - bits)) | (value >> (2 * bits - 8));
+}
+
+fn inline u32 bc1_expand565(u16 c, u32 channel)
+{
+    switch (channel)
+    {
+        case 0:  return bits_expand((u32)(c >> 11) & 31, 5);
+        case 1:  return bits_expand((u32)(c >> 5) & 63, 6);
+        default: return bits_expand((u32)c & 31, 5);
+    }
+}
+
+/*
+    The four colors of a BC1 block. Three colors and transparent black when the
+    first endpoint is not the larger one, unless the block is part of BC3
+*/
+fn void bc1_palette(u16 c0, u16 c1, bool four_colors, color4_t palette[4])
+{
+    for (u32 c = 0; c < 3; ++c)
+    {
+        u32 const a = bc1_expand565(c0, c);
+        u32 const b = bc1_expand565(c1, c);
+
+        u8 *p0 = (u8 *)&palette[0] + c;
+        u8 *p1 = (u8 *)&palette[1] + c;
+        u8 *p2 = (u8 *)&palette[2] + c;
+        u8 *p3 = (u8 *)&palette[3] + c;
+
+        *p0 = (u8)a;
+        *p1 = (u8)b;
+
+        if (four_colors || c0 > c1) {
+            *p2 = (u8)((2 * a + b + 1) / 3);
+            *p3 = (u8)((a + 2 * b + 1) / 3);
+        } else {
+            *p2 = (u8)((a + b + 1) / 2);
+            *p3 = 0;
+        }
+    }
+
+    palette[0].a = palette[1].a = palette[2].a = 255;
+    palette[3].a = (four_colors || c0 > c1) ? 255 : 0;
+}
+
+fn void bc1_decode(u8 const *block, bool four_colors, color4_t out[16])
+{
+    color4_t palette[4];
+    bc1_palette((u16)(block[0] | block[1] << 8), (u16)(block[2] | block[3] << 8), four_colors, palette);
+
+    u32 const indices = (u32)block[4] | (u32)block[5] << 8 | (u32)block[6] << 16 | (u32)block[7] << 24;
+
+    for (u32 i = 0; i < 16; ++i) {
+        out[i] = palette[(indices >> (2 * i)) & 3];
+    }
+}
+
+fn void bc3_alpha_palette(u32 a0, u32 a1, u8 palette[8])
+{
+    palette[0] = (u8)a0;
+    palette[1] = (u8)a1;
+
+    if (a0 > a1) {
+        for (u32 i = 1; i < 7; ++i) {
+            palette[i + 1] = (u8)(((7 - i) * a0 + i * a1 + 3) / 7);
+        }
+    } else {
+        for (u32 i = 1; i < 5; ++i) {
+            palette[i + 1] = (u8)(((5 - i) * a0 + i * a1 + 2) / 5);
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+fn void bc3_decode(u8 const *block, color4_t out[16])
+{
+    bc1_decode(block + 8, true, out);
+
+    u8 palette[8];
+    bc3_alpha_palette(block[0], block[1], palette);
+
+    u32 pos = 16;
+
+    for (u32 i = 0; i < 16; ++i) {
+        out[i].a = palette[bits_read(block, &pos, 3)];
+    }
+}
+
+fn void bc7_decode(u8 const *block, color4_t out[16])
+{
+    u32 mode = 0;
+
+    while (mode < 8 && !(block[0] & (1u << mode))) {
+        mode++;
+    }
+
+    // reserved mode
+    if (mode == 8) {
+        memset(out, 0, sizeof(color4_t) * 16);
+        return;
+    }
+
+    bc7_mode_t const *m = &bc7_modes[mode];
+
+    u32 pos = mode + 1;
+
+    u32 const partition = bits_read(block, &pos, m->partition_bits);
+    u32 const rotation  = bits_read(block, &pos, m->rotation_bits);
+    u32 const selector  = bits_read(block, &pos, m->selector_bits);
+
+    u32 endpoints[3][2][4];     // subset, endpoint, channel
+
+    for (u32 c = 0; c < 4; ++c) {
+        u32 const bits = c < 3 ? m->color_bits : m->alpha_bits;
+
+        for (u32 s = 0; s < m->subsets; ++s) {
+            endpoints[s][0][c] = bits_read(block, &pos, bits);
+            endpoints[s][1][c] = bits_read(block, &pos, bits);
+        }
+    }
+
+    u32 pbits[3][2] = {{0}};
+    u32 const has_pbit = m->endpoint_pbits | m->shared_pbits;
+
+    for (u32 s = 0; s < m->subsets; ++s) {
+        if (m->endpoint_pbits) {
+            pbits[s][0] = bits_read(block, &pos, 1);
+            pbits[s][1] = bits_read(block, &pos, 1);
+        } else if (m->shared_pbits) {
+            pbits[s][0] = pbits[s][1] = bits_read(block, &pos, 1);
+        }
+    }
+
+    for (u32 s = 0; s < m->subsets; ++s) {
+        for (u32 e = 0; e < 2; ++e) {
+            for (u32 c = 0; c < 4; ++c) {
+                u32 const bits = c < 3 ? m->color_bits : m->alpha_bits;
+
+                if (!bits) {
+                    endpoints[s][e][c] = 255;
+                } else if (has_pbit) {
+                    endpoints[s][e][c] = bits_expand(endpoints[s][e][c] << 1 | pbits[s][e], bits + 1);
+                } else {
+                    endpoints[s][e][c] = bits_expand(endpoints[s][e][c], bits);
+                }
+            }
+        }
+    }
+
+    u32 subset[16];
+    u32 index[16];
+    u32 index2[16];
+
+    for (u32 i = 0; i < 16; ++i)
+    {
+        subset[i] = m->subsets == 2 ? (bc7_partitions2[partition] >> i) & 1 :
+                    m->subsets == 3 ? (bc7_partitions3[partition] >> (2 * i)) & 3 : 0;
+
+        bool const anchor = i == 0 ||
+                            (m->subsets == 2 && i == bc7_anchors2[partition]) ||
+                            (m->subsets == 3 && (i == bc7_anchors3[0][partition] || i == bc7_anchors3[1][partition]));
+
+        index[i] = bits_read(block, &pos, m->index_bits - anchor);
+    }
+
+    for (u32 i = 0; m->index2_bits && i < 16; ++i) {
+        index2[i] = bits_read(block, &pos, m->index2_bits - (u32)(i == 0));
+    }
+
+    for (u32 i = 0; i < 16; ++i)
+    {
+        u32 const (*e)[4] = endpoints[subset[i]];
+
+        // with two index sets the selector picks the one the colors use
+        u32 const color_index = (m->index2_bits && selector) ? index2[i] : index[i];
+        u32 const color_bits  = (m->index2_bits && selector) ? m->index2_bits : m->index_bits;
+        u32 const alpha_index = (m->index2_bits && !selector) ? index2[i] : index[i];
+        u32 const alpha_bits  = (m->index2_bits && !selector) ? m->index2_bits : m->index_bits;
+
+        u8 texel[4] = {
+            bc7_interpolate(e[0][0], e[1][0], color_index, color_bits),
+            bc7_interpolate(e[0][1], e[1][1], color_index, color_bits),
+            bc7_interpolate(e[0][2], e[1][2], color_index, color_bits),
+            bc7_interpolate(e[0][3], e[1][3], alpha_index, alpha_bits),
+        };
+
+        if (rotation) {
+            u8 const tmp = texel[3];
+            texel[3] = texel[rotation - 1];
+            texel[rotation - 1] = tmp;
+        }
+        memcpy(&out[i], texel, sizeof(color4_t));
+    }
+}
+
+fn void texture_decode_block(texture_format_t format, u8 const *block, color4_t out[16])
+{
+    switch (format)
+    {
+        case TEXTURE_FORMAT_BC1:  bc1_decode(block, false, out); break;
+        case TEXTURE_FORMAT_BC3:  bc3_decode(block, out);        break;
+        case TEXTURE_FORMAT_BC7:  bc7_decode(block, out);        break;
+        case TEXTURE_FORMAT_RGBA8:
+        default:                  break;
+    }
+}
+
+/*
+    Endpoints of a block along the principal axis of its texels, from a few
+    power iterations on the covariance of the first `channels` channels
+*/
+fn void block_endpoints(color4_t const texels[16], u32 channels, f32 lo[4], f32 hi[4])
+{
+    f32 mean[4] = {0};
+
+    for (u32 i = 0; i < 16; ++i) {
+        u8 const *t = (u8 const *)&texels[i];
+
+        for (u32 c = 0; c < channels; ++c) {
+            mean[c] += (f32)t[c] * (1.f / 16.f);
+        }
+    }
+
+    f32 cov[4][4] = {{0}};
+
+    for (u32 i = 0; i < 16; ++i) {
+        u8 const *t = (u8 const *)&texels[i];
+
+        for (u32 a = 0; a < channels; ++a) {
+            for (u32 b = 0; b < channels; ++b) {
+                cov[a][b] += ((f32)t[a] - mean[a]) * ((f32)t[b] - mean[b]);
+            }
+        }
+    }
+
+    f32 axis[4] = {1.f, 1.f, 1.f, 1.f};
+
+    for (u32 iteration = 0; iteration < 8; ++iteration)
+    {
+        f32 next[4] = {0};
+        f32 length  = 0.f;
+
+        for (u32 a = 0; a < channels; ++a) {
+            for (u32 b = 0; b < channels; ++b) {
+                next[a] += cov[a][b] * axis[b];
+            }
+            length = MAX(length, fabsf(next[a]));
+        }
+
+        // flat blocks have no axis, the endpoints end up at the mean
+        if (length < 1e-6f) {
+            break;
+        }
+        for (u32 a = 0; a < channels; ++a) {
+            axis[a] = next[a] / length;
+        }
+    }
+
+    f32 tmin = 0.f, tmax = 0.f, norm = 0.f;
+
+    for (u32 c = 0; c < channels; ++c) {
+        norm += axis[c] * axis[c];
+    }
+
+    for (u32 i = 0; i < 16; ++i)
+    {
+        u8 const *t = (u8 const *)&texels[i];
+        f32 d = 0.f;
+
+        for (u32 c = 0; c < channels; ++c) {
+            d += ((f32)t[c] - mean[c]) * axis[c];
+        }
+        d /= norm;
+        tmin = MIN(tmin, d);
+        tmax = MAX(tmax, d);
+    }
+
+    for (u32 c = 0; c < channels; ++c) {
+        lo[c] = MAX(0.f, MIN(255.f, mean[c] + axis[c] * tmin));
+        hi[c] = MAX(0.f, MIN(255.f, mean[c] + axis[c] * tmax));
+    }
+}
+
+fn inline u32 color_distance(color4_t a, color4_t b, u32 channels)
+{
+    u8 const *pa = (u8 const *)&a;
+    u8 const *pb = (u8 const *)&b;
+
+    u32 d = 0;
+
+    for (u32 c = 0; c < channels; ++c) {
+        i32 const e = (i32)pa[c] - (i32)pb[c];
+        d += (u32)(e * e);
+    }
+    return d;
+}
+
+// nearest palette entry of every texel
+fn void block_indices(color4_t const texels[16], color4_t const *palette, u32 count, u32 channels, u32 out[16])
+{
+    for (u32 i = 0; i < 16; ++i)
+    {
+        u32 best = UINT32_MAX;
+
+        for (u32 p = 0; p < count; ++p) {
+            u32 const d = color_distance(texels[i], palette[p], channels);
+
+            if (d < best) {
+                best   = d;
+                out[i] = p;
+            }
+        }
+    }
+}
+
+fn inline u16 bc1_quantize565(f32 const c[4])
+{
+    u32 const r = (u32)(c[0] * 31.f / 255.f + 0.5f);
+    u32 const g = (u32)(c[1] * 63.f / 255.f + 0.5f);
+    u32 const b = (u32)(c[2] * 31.f / 255.f + 0.5f);
+
+    return (u16)(r << 11 | g << 5 | b);
+}
+
+/*
+    Always the four color mode, alpha is dropped
+*/
+fn void bc1_encode(color4_t const texels[16], u8 *block)
+{
+    f32 lo[4], hi[4];
+    block_endpoints(texels, 3, lo, hi);
+
+    u16 c0 = bc1_quantize565(hi);
+    u16 c1 = bc1_quantize565(lo);
+
+    if (c0 < c1) {
+        u16 const tmp = c0;
+        c0 = c1;
+        c1 = tmp;
+    }
+
+    color4_t palette[4];
+    bc1_palette(c0, c1, true, palette);
+
+    u32 index[16] = {0};
+
+    // equal endpoints would read as the three color mode, one color is enough
+    if (c0 != c1) {
+        block_indices(texels, palette, 4, 3, index);
+    }
+
+    u32 indices = 0;
+
+    for (u32 i = 0; i < 16; ++i) {
+        indices |= index[i] << (2 * i);
+    }
+
+    block[0] = (u8)c0;
+    block[1] = (u8)(c0 >> 8);
+    block[2] = (u8)c1;
+    block[3] = (u8)(c1 >> 8);
+    block[4] = (u8)indices;
+    block[5] = (u8)(indices >> 8);
+    block[6] = (u8)(indices >> 16);
+    block[7] = (u8)(indices >> 24);
+}
+
+fn void bc3_encode(color4_t const texels[16], u8 *block)
+{
+    u32 a0 = 0, a1 = 255;
+
+    for (u32 i = 0; i < 16; ++i) {
+        a0 = MAX(a0, texels[i].a);
+        a1 = MIN(a1, texels[i].a);
+    }
+
+    u8 palette[8];
+    bc3_alpha_palette(a0, a1, palette);
+
+    memset(block, 0, 8);
+    block[0] = (u8)a0;
+    block[1] = (u8)a1;
+
+    u32 pos = 16;
+
+    for (u32 i = 0; i < 16; ++i)
+    {
+        u32 best = 0, best_error = UINT32_MAX;
+
+        for (u32 p = 0; p < 8; ++p) {
+            u32 const e = (u32)abs((i32)palette[p] - (i32)texels[i].a);
+
+            if (e < best_error) {
+                best_error = e;
+                best       = p;
+            }
+        }
+        bits_write(block, &pos, 3, best);
+    }
+
+    bc1_encode(texels, block + 8);
+}
+
+/*
+    Mode 6, one subset of 7 bit RGBA endpoints with a low bit each and 4 bit
+    indices
+*/
+fn void bc7_encode_mode6(color4_t const texels[16], u8 *block)
+{
+    f32 lo[4], hi[4];
+    block_endpoints(texels, 4, lo, hi);
+
+    f32 const *target[2] = {lo, hi};
+
+    u32 endpoints[2][4];
+    u32 pbits[2];
+
+    // the low bit is shared by the channels, keep the one that fits best
+    for (u32 e = 0; e < 2; ++e)
+    {
+        f32 best_error = INFINITY;
+
+        for (u32 p = 0; p < 2; ++p)
+        {
+            u32 q[4];
+            f32 error = 0.f;
+
+            for (u32 c = 0; c < 4; ++c) {
+                q[c] = (u32)MAX(0, MIN(127, (i32)lrintf((target[e][c] - (f32)p) * 0.5f)));
+
+                // opaque blocks should stay opaque, alpha counts more
+                f32 const d = (f32)(q[c] << 1 | p) - target[e][c];
+                error += d * d * (c == 3 ? 4.f : 1.f);
+            }
+
+            if (error < best_error) {
+                best_error = error;
+                pbits[e]   = p;
+                memcpy(endpoints[e], q, sizeof(q));
+            }
+        }
+    }
+
+    color4_t palette[16];
+
+    for (u32 i = 0; i < 16; ++i) {
+        u8 *p = (u8 *)&palette[i];
+
+        for (u32 c = 0; c < 4; ++c) {
+            p[c] = bc7_interpolate(endpoints[0][c] << 1 | pbits[0], endpoints[1][c] << 1 | pbits[1], i, 4);
+        }
+    }
+
+    u32 index[16];
+    block_indices(texels, palette, 16, 4, index);
+
+    // the first index has its top bit implied zero, swapping the endpoints flips it
+    if (index[0] & 8) {
+        for (u32 c = 0; c < 4; ++c) {
+            u32 const tmp = endpoints[0][c];
+            endpoints[0][c] = endpoints[1][c];
+            endpoints[1][c] = tmp;
+        }
+
+        u32 const tmp = pbits[0];
+        pbits[0] = pbits[1];
+        pbits[1] = tmp;
+
+        for (u32 i = 0; i < 16; ++i) {
+            index[i] = 15 - index[i];
+        }
+    }
+
+    memset(block, 0, 16);
+
+    u32 pos = 0;
+    bits_write(block, &pos, 7, 1u << 6);
+
+    for (u32 c = 0; c < 4; ++c) {
+        bits_write(block, &pos, 7, endpoints[0][c]);
+        bits_write(block, &pos, 7, endpoints[1][c]);
+    }
+    bits_write(block, &pos, 1, pbits[0]);
+    bits_write(block, &pos, 1, pbits[1]);
+
+    for (u32 i = 0; i < 16; ++i) {
+        bits_write(block, &pos, i == 0 ? 3 : 4, index[i]);
+    }
+}
+
+/*
+    Mode 5, one subset of 7 bit colors and 8 bit alpha, each with 2 bit
+    indices of its own. Colors and alpha that vary independently fit better
+    than with mode 6
+*/
+fn void bc7_encode_mode5(color4_t const texels[16], u8 *block)
+{
+    f32 lo[4], hi[4];
+    block_endpoints(texels, 3, lo, hi);
+
+    u32 colors[2][3];
+    u32 alpha[2] = {255, 0};
+
+    for (u32 c = 0; c < 3; ++c) {
+        colors[0][c] = (u32)lrintf(lo[c] * 127.f / 255.f);
+        colors[1][c] = (u32)lrintf(hi[c] * 127.f / 255.f);
+    }
+
+    for (u32 i = 0; i < 16; ++i) {
+        alpha[0] = MIN(alpha[0], texels[i].a);
+        alpha[1] = MAX(alpha[1], texels[i].a);
+    }
+
+    color4_t palette[4];
+
+    for (u32 i = 0; i < 4; ++i) {
+        palette[i] = (color4_t){
+            bc7_interpolate(bits_expand(colors[0][0], 7), bits_expand(colors[1][0], 7), i, 2),
+            bc7_interpolate(bits_expand(colors[0][1], 7), bits_expand(colors[1][1], 7), i, 2),
+            bc7_interpolate(bits_expand(colors[0][2], 7), bits_expand(colors[1][2], 7), i, 2),
+            bc7_interpolate(alpha[0], alpha[1], i, 2),
+        };
+    }
+
+    u32 index[16];
+    u32 index2[16];
+    block_indices(texels, palette, 4, 3, index);
+
+    for (u32 i = 0; i < 16; ++i)
+    {
+        u32 best_error = UINT32_MAX;
+
+        for (u32 p = 0; p < 4; ++p) {
+            u32 const e = (u32)abs((i32)palette[p].a - (i32)texels[i].a);
+
+            if (e < best_error) {
+                best_error = e;
+                index2[i]  = p;
+            }
+        }
+    }
+
+    // both index sets have the top bit of their first index implied zero
+    if (index[0] & 2) {
+        for (u32 c = 0; c < 3; ++c) {
+            u32 const tmp = colors[0][c];
+            colors[0][c] = colors[1][c];
+            colors[1][c] = tmp;
+        }
+        for (u32 i = 0; i < 16; ++i) {
+            index[i] = 3 - index[i];
+        }
+    }
+
+    if (index2[0] & 2) {
+        u32 const tmp = alpha[0];
+        alpha[0] = alpha[1];
+        alpha[1] = tmp;
+
+        for (u32 i = 0; i < 16; ++i) {
+            index2[i] = 3 - index2[i];
+        }
+    }
+
+    memset(block, 0, 16);
+
+    u32 pos = 0;
+    bits_write(block, &pos, 6, 1u << 5);
+    bits_write(block, &pos, 2, 0);
+
+    for (u32 c = 0; c < 3; ++c) {
+        bits_write(block, &pos, 7, colors[0][c]);
+        bits_write(block, &pos, 7, colors[1][c]);
+    }
+    bits_write(block, &pos, 8, alpha[0]);
+    bits_write(block, &pos, 8, alpha[1]);
+
+    for (u32 i = 0; i < 16; ++i) {
+        bits_write(block, &pos, i == 0 ? 1 : 2, index[i]);
+    }
+    for (u32 i = 0; i < 16; ++i) {
+        bits_write(block, &pos, i == 0 ? 1 : 2, index2[i]);
+    }
+}
+
+fn u32 block_error(color4_t const texels[16], color4_t const decoded[16])
+{
+    u32 error = 0;
+
+    for (u32 i = 0; i < 16; ++i) {
+        error += color_distance(texels[i], decoded[i], 4);
+    }
+    return error;
+}
+
+/*
+    Modes 5 and 6 are both tried and the one closer to the texels is kept,
+    the partitioned modes only ever get decoded
+*/
+fn void bc7_encode(color4_t const texels[16], u8 *block)
+{
+    u8 candidate[16];
+    color4_t decoded[16];
+
+    bc7_encode_mode6(texels, block);
+    bc7_decode(block, decoded);
+
+    u32 const error6 = block_error(texels, decoded);
+
+    bc7_encode_mode5(texels, candidate);
+    bc7_decode(candidate, decoded);
+
+    if (block_error(texels, decoded) < error6) {
+        memcpy(block, candidate, 16);
+    }
+}
+
+fn inline u32 texture_block_size(texture_format_t format)
+{
+    return format == TEXTURE_FORMAT_BC1 ? 8 : 16;
+}
+
+// blocks a side of a level, levels under 4 texels take up one whole block
+fn inline u32 texture_block_log2(u32 size_log2)
+{
+    return size_log2 > 2 ? size_log2 - 2 : 0;
+}
+
+/*
+    Compressed copy of an RGBA8 texture, every level is encoded from the
+    filtered level of the source. Blocks are in Morton order like the texels
+*/
+fn texture_t *texture_encode(texture_t const *source, texture_format_t format)
+{
+    u32 const block_size = texture_block_size(format);
+
+    texture_t *texture = (texture_t *)CHECK_PTR(calloc(1, sizeof(texture_t)));
+
+    texture->format      = format;
+    texture->width       = source->width;
+    texture->height      = source->height;
+    texture->level_count = source->level_count;
+
+    size_t total = 0;
+
+    for (u32 l = 0; l < source->level_count; ++l) {
+        total += (size_t)block_size << (texture_block_log2(source->levels[l].width_log2) + texture_block_log2(source->levels[l].height_log2));
+    }
+
+    texture->data = CHECK_PTR(malloc(total));
+
+    u8 *blocks = (u8 *)texture->data;
+
+    for (u32 l = 0; l < source->level_count; ++l)
+    {
+        texture_level_t const *src = &source->levels[l];
+        texture_level_t       *dst = &texture->levels[l];
+
+        dst->blocks      = blocks;
+        dst->width_log2  = src->width_log2;
+        dst->height_log2 = src->height_log2;
+
+        u32 const bw = texture_block_log2(src->width_log2);
+        u32 const bh = texture_block_log2(src->height_log2);
+
+        for (u32 by = 0; by < 1u << bh; ++by) {
+            for (u32 bx = 0; bx < 1u << bw; ++bx)
+            {
+                color4_t texels[16];
+
+                // levels under 4 texels repeat them to fill the block
+                for (u32 i = 0; i < 16; ++i) {
+                    u32 const x = (bx * 4 + (i & 3)) & ((1u << src->width_log2) - 1);
+                    u32 const y = (by * 4 + (i >> 2)) & ((1u << src->height_log2) - 1);
+
+                    texels[i] = src->texels[texel_offset(src, x, y)];
+                }
+
+                u8 *block = blocks + (size_t)block_size * morton_offset(bw, bh, bx, by);
+
+                switch (format)
+                {
+                    case TEXTURE_FORMAT_BC1:  bc1_encode(texels, block); break;
+                    case TEXTURE_FORMAT_BC3:  bc3_encode(texels, block); break;
+                    case TEXTURE_FORMAT_BC7:  bc7_encode(texels, block); break;
+                    case TEXTURE_FORMAT_RGBA8:
+                    default:                  break;
+                }
+            }
+        }
+        blocks += (size_t)block_size << (bw + bh);
+    }
+    return texture;
+}
+
+/*
+    Compressed textures on disk, a header followed by the blocks of every
+    level as they are laid out in memory
+*/
+typedef struct texture_file_t
+{
+    char        magic[4];       // TXBC
+    u32         format;
+    u32         width_log2;
+    u32         height_log2;
+    u32         level_count;
+}texture_file_t;
+
+fn bool texture_save(texture_t const *texture, char const *path)
+{
+    if (texture->format == TEXTURE_FORMAT_RGBA8) {
+        return false;
+    }
+
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        fprintf(stdout, "Couldnt open file : %s\n", path);
+        return false;
+    }
+
+    texture_file_t const header = {
+        .magic       = {'T', 'X', 'B', 'C'},
+        .format      = (u32)texture->format,
+        .width_log2  = texture->levels[0].width_log2,
+        .height_log2 = texture->levels[0].height_log2,
+        .level_count = texture->level_count,
+    };
+
+    u8 const *last = texture->levels[texture->level_count - 1].blocks;
+    size_t const size = (size_t)(last - texture->levels[0].blocks) + texture_block_size(texture->format);
+
+    bool const ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(texture->data, 1, size, file) == size;
+
+    fclose(file);
+    return ok;
+}
+
+fn texture_t *texture_open(char const *path)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (!file) {
+        fprintf(stdout, "Couldnt open file : %s\n", path);
+        return NULL;
+    }
+
+    texture_file_t header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "TXBC", 4) ||
+        header.format < TEXTURE_FORMAT_BC1 || header.format > TEXTURE_FORMAT_BC7 ||
+        header.width_log2 >= MAX_TEXTURE_LEVELS || header.height_log2 >= MAX_TEXTURE_LEVELS ||
+        header.level_count != MAX(header.width_log2, header.height_log2) + 1)
+    {
+        fprintf(stdout, "Not a compressed texture : %s\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    texture_format_t const format = (texture_format_t)header.format;
+    u32 const block_size = texture_block_size(format);
+
+    texture_t *texture = (texture_t *)CHECK_PTR(calloc(1, sizeof(texture_t)));
+
+    texture->format      = format;
+    texture->width       = 1u << header.width_log2;
+    texture->height      = 1u << header.height_log2;
+    texture->level_count = header.level_count;
+
+    size_t total = 0;
+
+    for (u32 l = 0; l < texture->level_count; ++l)
+    {
+        texture_level_t *level = &texture->levels[l];
+
+        level->width_log2  = MAX(header.width_log2, l) - l;
+        level->height_log2 = MAX(header.height_log2, l) - l;
+
+        total += (size_t)block_size << (texture_block_log2(level->width_log2) + texture_block_log2(level->height_log2));
+    }
+
+    texture->data = CHECK_PTR(malloc(total));
+
+    u8 *blocks = (u8 *)texture->data;
+
+    for (u32 l = 0; l < texture->level_count; ++l) {
+        texture->levels[l].blocks = blocks;
+        blocks += (size_t)block_size << (texture_block_log2(texture->levels[l].width_log2) + texture_block_log2(texture->levels[l].height_log2));
+    }
+
+    if (fread(texture->data, 1, total, file) != total) {
+        fprintf(stdout, "Truncated texture : %s\n", path);
+        fclose(file);
+        free(texture->data);
+        free(texture);
+        return NULL;
+    }
+
+    fclose(file);
+    return texture;
+}
+
+/*
+    Compress the image at `source` ahead of time into a file texture_open
+    reads back, so the renderer does not have to encode it on every start
+*/
+fn bool texture_convert(char const *source, char const *path, texture_format_t format)
+{
+    texture_t *image = texture_load(source);
+
+    if (!image) {
+        return false;
+    }
+
+    texture_t *compressed = texture_encode(image, format);
+    texture_free(image);
+
+    bool const ok = texture_save(compressed, path);
+    texture_free(compressed);
+
+    return ok;
+}
+
+/* ----------------  Sampling -------------------- */
+
+/*
+    Texel (x, y) of a level. Blocks are decoded whole into the cache of the
+    calling thread, a sample's footprint and its neighbours mostly hit it
+*/
+fn inline color4_t texel_fetch(texture_t const *texture, texture_level_t const *level, texture_cache_t *cache, u32 x, u32 y)
+{
+    if (texture->format == TEXTURE_FORMAT_RGBA8) {
+        return level->texels[texel_offset(level, x, y)];
+    }
+
+    u32 const block_size = texture_block_size(texture->format);
+
+    u8 const *block = level->blocks + (size_t)block_size * morton_offset(texture_block_log2(level->width_log2),
+                                                                        texture_block_log2(level->height_log2), x >> 2, y >> 2);
+
+    u32 const slot = (u32)((uintptr_t)block / block_size) & (TEXTURE_CACHE_SIZE - 1);
+
+    if (cache->tags[slot] != block) {
+        texture_decode_block(texture->format, block, cache->texels[slot]);
+        cache->tags[slot] = block;
+    }
+    return cache->texels[slot][(x & 3) + (y & 3) * 4];
+}
+
+fn inline u32 texel_wrap(wrap_t wrap, i32 c, u32 size_log2)
+{
+    return wrap == WRAP_REPEAT ? (u32)c & ((1u << size_log2) - 1) : (u32)MAX(0, MIN(c, (i32)(1u << size_log2) - 1));
+}
+
+/*
+    One sample of a level, u and v are 0 to 1 across it
+*/
+fn void texture_sample_level(texture_t const *texture, texture_level_t const *level, texture_cache_t *cache,
+                              sampler_t sampler, f32 u, f32 v, f32 out[4])
+{
+    f32 const x = u * (f32)(1u << level->width_log2);
+    f32 const y = v * (f32)(1u << level->height_log2);
+
+    if (sampler.filter == FILTER_NEAREST)
+    {
+        color4_t const t = texel_fetch(texture, level, cache, texel_wrap(sampler.wrap, (i32)floorf(x), level->width_log2),
+                                                              texel_wrap(sampler.wrap, (i32)floorf(y), level->height_log2));
+        out[0] = (f32)t.r;
+        out[1] = (f32)t.g;
+        out[2] = (f32)t.b;
+        out[3] = (f32)t.a;
+        return;
+    }
+
+    // texel centers are at half coordinates
+    f32 const fx = floorf(x - 0.5f);
+    f32 const fy = floorf(y - 0.5f);
+    f32 const ax = x - 0.5f - fx;
+    f32 const ay = y - 0.5f - fy;
+
+    u32 const x0 = texel_wrap(sampler.wrap, (i32)fx,     level->width_log2);
+    u32 const x1 = texel_wrap(sampler.wrap, (i32)fx + 1, level->width_log2);
+    u32 const y0 = texel_wrap(sampler.wrap, (i32)fy,     level->height_log2);
+    u32 const y1 = texel_wrap(sampler.wrap, (i32)fy + 1, level->height_log2);
+
+    color4_t const t00 = texel_fetch(texture, level, cache, x0, y0);
+    color4_t const t10 = texel_fetch(texture, level, cache, x1, y0);
+    color4_t const t01 = texel_fetch(texture, level, cache, x0, y1);
+    color4_t const t11 = texel_fetch(texture, level, cache, x1, y1);
+
+    __m128 const c00 = _mm_cvtepi32_ps(_mm_setr_epi32(t00.r, t00.g, t00.b, t00.a));
+    __m128 const c10 = _mm_cvtepi32_ps(_mm_setr_epi32(t10.r, t10.g, t10.b, t10.a));
+    __m128 const c01 = _mm_cvtepi32_ps(_mm_setr_epi32(t01.r, t01.g, t01.b, t01.a));
+    __m128 const c11 = _mm_cvtepi32_ps(_mm_setr_epi32(t11.r, t11.g, t11.b, t11.a));
+
+    __m128 const wx  = _mm_set1_ps(ax);
+    __m128 const top = _mm_add_ps(c00, _mm_mul_ps(_mm_sub_ps(c10, c00), wx));
+    __m128 const bot = _mm_add_ps(c01, _mm_mul_ps(_mm_sub_ps(c11, c01), wx));
+
+    _mm_storeu_ps(out, _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bot, top), _mm_set1_ps(ay))));
+}
+
+/*
+    Sample a texture at the four lanes of a fragment quad, colors are 0 to 1
+    as rgba x lane. The level of detail of each lane comes from the screen
+    space derivatives of u and v across the quad
+*/
+fn void texture_sample(texture_t const *texture, sampler_t sampler, __m128 u, __m128 v, f32 out[4][4])
+{
+    __m128 const w = _mm_set1_ps((f32)texture->width);
+    __m128 const h = _mm_set1_ps((f32)texture->height);
+
+    __m128 const ux = _mm_mul_ps(quad_ddx(u), w);
+    __m128 const vx = _mm_mul_ps(quad_ddx(v), h);
+    __m128 const uy = _mm_mul_ps(quad_ddy(u), w);
+    __m128 const vy = _mm_mul_ps(quad_ddy(v), h);
+
+    // squared texels per pixel along the longer axis of the footprint
+    f32 rho[4], us[4], vs[4];
+    _mm_storeu_ps(rho, _mm_max_ps(_mm_add_ps(_mm_mul_ps(ux, ux), _mm_mul_ps(vx, vx)),
+                                  _mm_add_ps(_mm_mul_ps(uy, uy), _mm_mul_ps(vy, vy))));
+    _mm_storeu_ps(us, u);
+    _mm_storeu_ps(vs, v);
+
+    f32 const max_lod = (f32)(texture->level_count - 1);
+
+    texture_cache_t *cache = &texture_caches[omp_get_thread_num()];
+
+    for (u32 lane = 0; lane < 4; ++lane)
+    {
+        f32 lod = 0.5f * log2f(rho[lane]);
+
+        // magnified, or no derivatives at all
+        if (!(lod > 0.f)) {
+            lod = 0.f;
+        }
+        lod = MIN(lod, max_lod);
+
+        f32 texel[4];
+
+        if (sampler.filter == FILTER_TRILINEAR)
+        {
+            u32 const l0 = (u32)lod;
+            u32 const l1 = MIN(l0 + 1, texture->level_count - 1);
+            f32 const t  = lod - (f32)l0;
+
+            f32 a[4], b[4];
+            texture_sample_level(texture, &texture->levels[l0], cache, sampler, us[lane], vs[lane], a);
+            texture_sample_level(texture, &texture->levels[l1], cache, sampler, us[lane], vs[lane], b);
+
+            for (u32 c = 0; c < 4; ++c) {
+                texel[c] = a[c] + (b[c] - a[c]) * t;
+            }
+        }
+        else
+        {
+            texture_sample_level(texture, &texture->levels[(u32)(lod + 0.5f)], cache, sampler, us[lane], vs[lane], texel);
+        }
+
+        for (u32 c = 0; c < 4; ++c) {
+            out[c][lane] = texel[c] * (1.f / 255.f);
+        }
+    }
+}
+
+/* ----------------  Built-in shaders -------------------- */
+
+/*
+    Vertex colors, the same output as the fixed-function pipeline with
+    perspective interpolation, and their alpha for the blended draws
+*/
+fn void vertex_color_vs(void const *uniforms, shader_vertices_t const *in, shader_varyings_t *out)
+{
+    (void) uniforms;
+
+    mat4x4_t const *m = in->transform;
+
+    for (u32 i = 0; i < in->count; ++i)
+    {
+        vec4f_t const p    = {in->position.x[i], in->position.y[i], in->position.z[i], in->position.w[i]};
+        vec4f_t const clip = vec4f_mat_mul(m, &p);
+
+        out->position.x[i] = clip.x;
+        out->position.y[i] = clip.y;
+        out->position.z[i] = clip.z;
+        out->position.w[i] = clip.w;
+
+        out->varyings[0][i] = (f32)in->color[i].r / 255.f;
+        out->varyings[1][i] = (f32)in->color[i].g / 255.f;
+        out->varyings[2][i] = (f32)in->color[i].b / 255.f;
+        out->varyings[3][i] = (f32)in->color[i].a / 255.f;
+    }
+}
+
+fn inline void vertex_color_fs(void const *uniforms, shader_quad_t const *quad, f32 color[4][4])
+{
+    (void) uniforms;
+
+    _mm_storeu_ps(color[0], quad_varying(quad, 0));
+    _mm_storeu_ps(color[1], quad_varying(quad, 1));
+    _mm_storeu_ps(color[2], quad_varying(quad, 2));
+    _mm_storeu_ps(color[3], quad_varying(quad, 3));
+}
+
+SHADER_KERNEL(vertex_color, vertex_color_fs, 4)
+
+global_variable shader_t const shader_vertex_color = {
+    .vertex        = vertex_color_vs,
+    .fragment      = vertex_color_fs,
+    .varying_count = 4,
+    .rasterize     = rasterize_vertex_color,
+};
+
+typedef struct textured_uniforms_t
+{
+    texture_t const *texture;
+    sampler_t       sampler;
+    attribute_t     texcoords;      // vec2f_t per vertex
+}textured_uniforms_t;
+
+/*
+    A texture modulated by the vertex colors
+*/
+fn void textured_vs(void const *uniforms, shader_vertices_t const *in, shader_varyings_t *out)
+{
+    textured_uniforms_t const *u = (textured_uniforms_t const *)uniforms;
+
+    vertex_color_vs(uniforms, in, out);
+
+    for (u32 i = 0; i < in->count; ++i)
+    {
+        vec2f_t const *uv = (vec2f_t const *)ATTR_AT(u->texcoords, in->index[i]);
+
+        out->varyings[4][i] = uv->x;
+        out->varyings[5][i] = uv->y;
+    }
+}
+
+fn inline void textured_fs(void const *uniforms, shader_quad_t const *quad, f32 color[4][4])
+{
+    textured_uniforms_t const *u = (textured_uniforms_t const *)uniforms;
+
+    texture_sample(u->texture, u->sampler, quad_varying(quad, 4), quad_varying(quad, 5), color);
+
+    for (u32 c = 0; c < 4; ++c) {
+        _mm_storeu_ps(color[c], _mm_mul_ps(_mm_loadu_ps(color[c]), quad_varying(quad, c)));
+    }
+}
+
+SHADER_KERNEL(textured, textured_fs, 6)
+
+global_variable shader_t const shader_textured = {
+    .vertex        = textured_vs,
+    .fragment      = textured_fs,
+    .varying_count = 6,
+    .rasterize     = rasterize_textured,
+};
+
+global_variable rasterize_fn_t        rasterize_triangle  = rasterize_triangle_sse41;
+global_variable rasterize_fn_t const *rasterize_variants  = rasterize_triangle_sse41_variants;
+global_variable transform_fn_t        transform_positions = transform_positions_sse41;
+
+fn void raster_init(void)
+{
+    cpu = cpu_detect();
+    binner_init(&binner);
+
+    if (!cpu.sse41) {
+        fprintf(stderr, "SSE4.1 is required\n");
+        exit(1);
+    }
+
+    if (cpu.avx2 && cpu.fma) {
+        rasterize_triangle  = rasterize_triangle_avx2;
+        rasterize_variants  = rasterize_triangle_avx2_variants;
+        transform_positions = transform_positions_avx2;
+    }
+
+    if (cpu.avx512f) {
+        transform_positions = transform_positions_avx512;
+    }
+}
+
+/*
+    Position of the state in RASTER_VARIANTS, -1 when it has no specialized kernel
+*/
+fn i32 pipeline_variant(pipeline_state_t const *pipeline, depth_view_t const *depth)
+{
+    i32 const smooth = pipeline_smooth(pipeline);
+
+    if (!depth || !pipeline->depth.test) {
+        return smooth;
+    }
+
+    i32 compare;
+
+    switch (pipeline->depth.compare)
+    {
+        case COMPARE_LESS:          compare = 0; break;
+        case COMPARE_LESS_EQUAL:    compare = 1; break;
+        case COMPARE_GREATER:       compare = 2; break;
+        case COMPARE_GREATER_EQUAL: compare = 3; break;
+        default:                    return -1;
+    }
+    return 2 + (pipeline->depth.write ? 4 * 3 * 2 : 0) + compare * 3 * 2 + (i32)depth->format * 2 + smooth;
+}
+
+/*
+    Bind a pipeline to a framebuffer, the kernel has every state branch
+    resolved at compile time when one exists for the state. Stencil tests
+    take the generic one
+*/
+fn rasterize_fn_t pipeline_kernel(pipeline_state_t const *pipeline, framebuffer_t const *fb)
+{
+    if (pipeline_stencil(pipeline, fb)) {
+        return rasterize_triangle;
+    }
+
+    i32 const variant = pipeline_variant(pipeline, fb->depth);
+
+    return variant >= 0 ? rasterize_variants[variant] : rasterize_triangle;
+}
+
+/*
+    Vertex stage of a programmable draw, positions are only decoded to object
+    space and the shader outputs clip space itself
+*/
+fn void vertex_stage_shader(draw_command_t const *command, draw_instance_t const *instance, viewport_t const *vp, vec2f_t guard,
+                            u32 const *remap, u32 first, u32 count, post_vertex_t *out, f32 *out_varyings)
+{
+    shader_t const *shader = command->shader;
+
+    mat4x4_t decode;
+
+    if (!position_decode(&command->mesh, &decode)) {
+        decode = mat_identity();
+    }
+
+    shader_vertices_t in;
+    shader_varyings_t varyings;
+
+    in.transform = &instance->transform;
+
+    for (u32 offset = 0; offset < count; offset += VERTEX_BATCH)
+    {
+        u32 const batch_count = MIN(VERTEX_BATCH, count - offset);
+
+        transform_positions(&decode, command->mesh.positions, remap, first + offset, batch_count, &in.position);
+        in.count = batch_count;
+
+        for (u32 i = 0; i < batch_count; ++i)
+        {
+            u32 const vidx = remap ? remap[first + offset + i] : first + offset + i;
+
+            in.index[i] = vidx;
+            in.color[i] = (command->pipeline.attributes & ATTRIBUTE_COLOR) ? attribute_color(command->mesh.colors, vidx)
+                                                                           : (color4_t){255, 255, 255, 255};
+            if (instance->tint) {
+                in.color[i] = color4_modulate(in.color[i], instance->color);
+            }
+        }
+
+        shader->vertex(command->uniforms, &in, &varyings);
+
+        for (u32 i = 0; i < batch_count; ++i)
+        {
+            f32 *dst = &out_varyings[(size_t)(offset + i) * shader->varying_count];
+
+            for (u32 v = 0; v < shader->varying_count; ++v) {
+                dst[v] = varyings.varyings[v][i];
+            }
+
+            clip_vertex_t const cv = {
+                .position = {varyings.position.x[i], varyings.position.y[i], varyings.position.z[i], varyings.position.w[i]},
+                .color    = in.color[i],
+                .varyings = shader->varying_count ? dst : NULL,
+            };
+            out[offset + i] = vertex_project(vp, &cv, guard);
+        }
+    }
+}
+
+/*
+    Vertex stage for `count` vertices starting at `first`, read directly or through
+    `remap`, written to out[0, count) in batches. Programmable draws write the
+    varyings of each vertex to out_varyings
+*/
+fn void vertex_stage(draw_command_t const *command, draw_instance_t const *instance, viewport_t const *vp, vec2f_t guard,
+                     u32 const *remap, u32 first, u32 count, post_vertex_t *out, f32 *out_varyings)
+{
+    if (command->shader) {
+        vertex_stage_shader(command, instance, vp, guard, remap, first, count, out, out_varyings);
+        return;
+    }
+
+    for (u32 offset = 0; offset < count; offset += VERTEX_BATCH)
+    {
+        u32 const batch_count = MIN(VERTEX_BATCH, count - offset);
+
+        vertex_batch_t batch;
+        transform_positions(&instance->vertex_transform, command->mesh.positions, remap, first + offset, batch_count, &batch);
+
+        for (u32 i = 0; i < batch_count; ++i)
+        {
+            u32 const vidx = remap ? remap[first + offset + i] : first + offset + i;
+
+            clip_vertex_t cv = {
+                .position = {batch.x[i], batch.y[i], batch.z[i], batch.w[i]},
+                .color    = {255, 255, 255, 255},
+            };
+
+            if (command->pipeline.attributes & ATTRIBUTE_COLOR) {
+                cv.color = attribute_color(command->mesh.colors, vidx);
+            }
+
+            if (instance->tint) {
+                cv.color = color4_modulate(cv.color, instance->color);
+            }
+            out[offset + i] = vertex_project(vp, &cv, guard);
+        }
+    }
+}
+
+/*
+    Varyings of post-transform vertex `vertex`, NULL when the draw has none
+*/
+fn inline f32 *binner_varyings(u32 vertex, u32 varying_count)
+{
+    return varying_count ? &binner.varyings[(size_t)vertex * varying_count] : NULL;
+}
+
+/*
+    Clip, set up and bin one triangle of transformed vertices, `id` is what it
+    writes to the visibility buffer when the framebuffer has one
+*/
+fn void assemble_triangle(raster_thread_t *thread, framebuffer_t const *fb, draw_command_t const *command, viewport_t const *vp,
+                          hiz_t const *hiz, vec2f_t guard, post_vertex_t const *pv[3], u32 id)
+{
+    // all vertices outside the same plane
+    if (pv[0]->outcode & pv[1]->outcode & pv[2]->outcode) {
+        return;
+    }
+
+    u32 const clip_or       = pv[0]->outcode | pv[1]->outcode | pv[2]->outcode;
+    u32 const varying_count = command->shader ? command->shader->varying_count : 0;
+
+    if (!clip_or) {
+        raster_tri_t *tri = thread_push_tri(thread, varying_count);
+
+        if (setup_triangle(tri, fb, command, vp, pv, &pv[0]->clip)) {
+            if (fb->visibility) {
+                tri->flat_color = id;
+            }
+            bin_triangle(thread, hiz, fb, command);
+        }
+        return;
+    }
+
+    clip_vertex_t const cv[3] = {pv[0]->clip, pv[1]->clip, pv[2]->clip};
+    clip_vertex_t poly[MAX_CLIP_VERTICES];
+    f32           lerps[MAX_CLIP_LERPS][MAX_VARYINGS];
+
+    u32 const count = clip_triangle(cv, poly, clip_or, guard, lerps, varying_count);
+
+    if (count < 3) {
+        return;
+    }
+
+    // the clipped polygon is convex, emit it as a fan
+    post_vertex_t const first = vertex_project(vp, &poly[0], guard);
+    post_vertex_t next        = vertex_project(vp, &poly[1], guard);
+
+    for (u32 i = 1; i + 1 < count; ++i)
+    {
+        post_vertex_t const prev = next;
+        next = vertex_project(vp, &poly[i + 1], guard);
+
+        post_vertex_t const *fan[3] = {&first, &prev, &next};
+        raster_tri_t *tri = thread_push_tri(thread, varying_count);
+
+        // the fan starts at a new vertex when the first one was clipped away,
+        // flat shading keeps the one of the original triangle
+        if (setup_triangle(tri, fb, command, vp, fan, &pv[0]->clip)) {
+            if (fb->visibility) {
+                tri->flat_color = id;
+            }
+            bin_triangle(thread, hiz, fb, command);
+        }
+    }
+}
+
+/*
+    True when a meshlet is outside the frustum of the instance or, when its
+    cone can cull, faces away from the eye with every triangle
+*/
+fn inline bool meshlet_cull(meshlet_t const *m, draw_instance_t const *instance, raster_stats_t *stats)
+{
+    if (frustum_cull_sphere(&instance->frustum, &m->center, m->radius)) {
+        stats->meshlets_frustum_culled++;
+        return true;
+    }
+
+    if (instance->cone) {
+        vec3f_t const d = vec3f_sub(&m->cone_apex, &instance->eye);
+        vec3f_t const v = vec3f_normalize(&d);
+
+        if (vec3f_dot(&v, &m->cone_axis) >= m->cone_cutoff) {
+            stats->meshlets_cone_culled++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Transform and culling state of instance `index` of a draw, false when the
+    instance is outside the frustum
+*/
+fn bool instance_setup(draw_instance_t *instance, draw_command_t const *command, u32 index)
+{
+    if (command->instance_count) {
+        mat4x4_t const *model = (mat4x4_t const *)ATTR_AT(command->instance_transforms, index);
+        instance->transform = mat4x4_mult(model, &command->transform);
+    } else {
+        instance->transform = command->transform;
+    }
+
+    // meshlets and whole instances are culled in the space of the mesh
+    instance->frustum = frustum_from_matrix(&instance->transform);
+
+    // the kernels transform raw position values, decoding them is part of the transform
+    mat4x4_t decode;
+    instance->vertex_transform = position_decode(&command->mesh, &decode) ? mat4x4_mult(&decode, &instance->transform) : instance->transform;
+
+    if (command->mesh.bounds && frustum_cull_bounds(&instance->frustum, command->mesh.bounds)) {
+        return false;
+    }
+
+    instance->tint  = command->instance_count && command->instance_colors.ptr;
+    instance->color = instance->tint ? *(color4_t const *)ATTR_AT(command->instance_colors, index) : (color4_t){255, 255, 255, 255};
+
+    mat4x4_t const *m     = &instance->transform;
+    vec4f_t  const  eye_h = mat_eye_position(m);
+
+    instance->eye = (vec3f_t){eye_h.x / eye_h.w, eye_h.y / eye_h.w, eye_h.z / eye_h.w};
+
+    // the cones hold the normals of counter-clockwise triangles, which are the
+    // ones clockwise culling keeps while the eye is in front of the x, y and w
+    // rows. the depth row plays no part in the winding on screen, so forward
+    // and reversed depth agree
+    instance->cone = (command->pipeline.cull_mode == CULL_MODE_CW  && eye_h.w > 0.f) ||
+                     (command->pipeline.cull_mode == CULL_MODE_CCW && eye_h.w < 0.f);
+    return true;
+}
+
+/* ----------------  Visibility buffer -------------------- */
+
+fn void visibility_resize(visibility_t *vis, u32 width, u32 height)
+{
+    free(vis->ids.pixels);
+    vis->ids.pixels = (color4_t *)CHECK_PTR(malloc(sizeof(u32) * width * height));
+    vis->ids.width  = width;
+    vis->ids.height = height;
+
+    memset(vis->ids.pixels, 0xFF, sizeof(u32) * width * height);
+
+    vis->draw_count     = 0;
+    vis->instance_count = 0;
+    vis->record_count   = 0;
+}
+
+/*
+    Triangle of a visibility id, ready to be shaded at any pixel it covers
+*/
+typedef struct visibility_tri_t
+{
+    u32         id;
+    bool        smooth;
+    color4_t    flat;
+    f64         weight[3];      // plane of the sum of the perspective weights, in pixel coordinates
+    f64         color[3][3];    // planes of r, g, b times the weights
+}visibility_tri_t;
+
+/*
+    Set up the triangle behind an id. The weights of the vertices at a pixel
+    solve (x, y, w) of the clip space vertices against the pixel, which stays
+    exact for triangles that were clipped
+*/
+fn void visibility_setup(visibility_t const *vis, u32 id, visibility_tri_t *out)
+{
+    u32                      const record   = id >> VISIBILITY_TRIANGLE_BITS;
+    visibility_draw_t        const *draw    = &vis->draws[vis->record_draws[record]];
+    draw_command_t           const *command = &draw->command;
+    mesh_t                   const *mesh    = &command->mesh;
+
+    u32 const primitive = id - (draw->first_record << VISIBILITY_TRIANGLE_BITS);
+    u32 const triangle  = primitive % draw->instance_triangles;
+
+    draw_instance_t const *instance = &vis->instances[draw->first_instance + primitive / draw->instance_triangles];
+
+    u32 v[3];
+
+    if (mesh->meshlets) {
+        meshlet_t const *m      = &mesh->meshlets[triangle / MESHLET_MAX_TRIANGLES];
+        u8        const *corner = &mesh->meshlet_triangles[(m->triangle_offset + triangle % MESHLET_MAX_TRIANGLES) * 3];
+
+        for (u32 i = 0; i < 3; ++i) {
+            v[i] = mesh->meshlet_vertices[m->vertex_offset + corner[i]];
+        }
+    } else {
+        mesh_triangle(mesh, triangle, v);
+    }
+
+    vertex_batch_t batch;
+    transform_positions(&instance->vertex_transform, mesh->positions, v, 0, 3, &batch);
+
+    color4_t c[3];
+
+    for (u32 i = 0; i < 3; ++i)
+    {
+        c[i] = (color4_t){255, 255, 255, 255};
+
+        if (command->pipeline.attributes & ATTRIBUTE_COLOR) {
+            c[i] = attribute_color(mesh->colors, v[i]);
+        }
+        if (instance->tint) {
+            c[i] = color4_modulate(c[i], instance->color);
+        }
+    }
+
+    out->id     = id;
+    out->flat   = c[0];
+    out->smooth = pipeline_smooth(&command->pipeline);
+
+    if (!out->smooth) {
+        return;
+    }
+
+    // normalized device coordinates of the center of pixel (x, y) are
+    // (ax * x + bx, ay * y + by)
+    viewport_t const *vp = &draw->viewport;
+
+    f64 const ax = 2.0 / (vp->xmax - vp->xmin);
+    f64 const ay = -2.0 / (vp->ymax - vp->ymin);
+    f64 const bx = (0.5 - vp->xmin) * ax - 1.0;
+    f64 const by = (0.5 - vp->ymin) * ay + 1.0;
+
+    memset(out->weight, 0, sizeof(out->weight));
+    memset(out->color,  0, sizeof(out->color));
+
+    for (u32 i = 0; i < 3; ++i)
+    {
+        u32 const j = (i + 1) % 3;
+        u32 const k = (i + 2) % 3;
+
+        // row i of the adjugate of the matrix with the vertices as columns
+        f64 const ex = (f64)batch.y[j] * batch.w[k] - (f64)batch.w[j] * batch.y[k];
+        f64 const ey = (f64)batch.w[j] * batch.x[k] - (f64)batch.x[j] * batch.w[k];
+        f64 const ez = (f64)batch.x[j] * batch.y[k] - (f64)batch.y[j] * batch.x[k];
+
+        f64 const plane[3] = {ex * ax, ey * ay, ex * bx + ey * by + ez};
+        f64 const rgb[3]   = {c[i].r, c[i].g, c[i].b};
+
+        for (u32 p = 0; p < 3; ++p)
+        {
+            out->weight[p] += plane[p];
+
+            for (u32 ch = 0; ch < 3; ++ch) {
+                out->color[ch][p] += plane[p] * rgb[ch];
+            }
+        }
+    }
+}
+
+/*
+    Shade every pixel that holds an id with the draw it belongs to, one setup
+    per run of pixels of the same triangle, then empty the buffer for the next
+    draws. Tiles are independent and resolved in parallel
+*/
+fn void visibility_resolve(framebuffer_t const *fb)
+{
+    visibility_t *vis = fb->visibility;
+
+    if (!vis->record_count) {
+        return;
+    }
+
+    image_view_t const *color = fb->color;
+    image_view_t const *ids   = &vis->ids;
+
+    u32 const width   = MIN(ids->width,  color->width);
+    u32 const height  = MIN(ids->height, color->height);
+    i32 const tiles_x = (i32)((width  + TILE_SIZE - 1) >> TILE_SIZE_LOG2);
+    i32 const tiles_y = (i32)((height + TILE_SIZE - 1) >> TILE_SIZE_LOG2);
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(binner.thread_count)
+    for (i32 tile = 0; tile < tiles_x * tiles_y; ++tile)
+    {
+        u32 const x0 = (u32)(tile % tiles_x) * TILE_SIZE;
+        u32 const y0 = (u32)(tile / tiles_x) * TILE_SIZE;
+        u32 const x1 = MIN(x0 + TILE_SIZE, width);
+        u32 const y1 = MIN(y0 + TILE_SIZE, height);
+
+        visibility_tri_t tri = {.id = VISIBILITY_EMPTY};
+
+        for (u32 y = y0; y < y1; ++y)
+        {
+            for (u32 x = x0; x < x1; ++x)
+            {
+                color4_t *cell = &COLOR_BUF_AT(ids, x, y);
+
+                u32 id;
+                memcpy(&id, cell, sizeof(u32));
+
+                if (id == VISIBILITY_EMPTY) {
+                    continue;
+                }
+                memset(cell, 0xFF, sizeof(u32));
+
+                if (id != tri.id) {
+                    visibility_setup(vis, id, &tri);
+                }
+
+                if (!tri.smooth) {
+                    COLOR_BUF_AT(color, x, y) = (color4_t){tri.flat.r, tri.flat.g, tri.flat.b, 255};
+                    continue;
+                }
+
+                f64 const px = (f64)x;
+                f64 const py = (f64)y;
+                f64 const w  = 1.0 / (tri.weight[0] * px + tri.weight[1] * py + tri.weight[2]);
+
+                f64 const r = (tri.color[0][0] * px + tri.color[0][1] * py + tri.color[0][2]) * w;
+                f64 const g = (tri.color[1][0] * px + tri.color[1][1] * py + tri.color[1][2]) * w;
+                f64 const b = (tri.color[2][0] * px + tri.color[2][1] * py + tri.color[2][2]) * w;
+
+                COLOR_BUF_AT(color, x, y) = (color4_t){
+                    (u8)MAX(0, MIN(255, (i32)r)),
+                    (u8)MAX(0, MIN(255, (i32)g)),
+                    (u8)MAX(0, MIN(255, (i32)b)),
+                    255,
+                };
+            }
+        }
+    }
 
-        f32 det012 = vec4f_det2D(&v10, &v20);
+    vis->draw_count     = 0;
+    vis->instance_count = 0;
+    vis->record_count   = 0;
+}
+
+/*
+    Give the visible instances of a draw a range of ids, resolving what the
+    buffer holds first when the ids run out. False when the draw alone needs
+    more ids than there are, it is then shaded as it is rasterized
+*/
+fn bool visibility_record(framebuffer_t const *fb, draw_command_t const *command, viewport_t const *vp,
+                          u32 instance_count, u32 instance_triangles, u32 *first_id)
+{
+    visibility_t *vis = fb->visibility;
+
+    u64 const ids     = (u64)instance_count * instance_triangles;
+    u64 const records = (ids + (1u << VISIBILITY_TRIANGLE_BITS) - 1) >> VISIBILITY_TRIANGLE_BITS;
+
+    if (vis->record_count + records > VISIBILITY_MAX_RECORDS) {
+        visibility_resolve(fb);
+    }
+    if (records > VISIBILITY_MAX_RECORDS) {
+        return false;
+    }
+
+    if (vis->draw_count >= vis->draw_capacity) {
+        vis->draw_capacity = vis->draw_capacity ? vis->draw_capacity * 2 : 64;
+        vis->draws         = (visibility_draw_t *)CHECK_PTR(realloc(vis->draws, sizeof(visibility_draw_t) * vis->draw_capacity));
+    }
+    if (vis->instance_count + instance_count > vis->instance_capacity) {
+        vis->instance_capacity = MAX(vis->instance_capacity * 2, vis->instance_count + instance_count);
+        vis->instances         = (draw_instance_t *)CHECK_PTR(realloc(vis->instances, sizeof(draw_instance_t) * vis->instance_capacity));
+    }
+
+    memcpy(&vis->instances[vis->instance_count], binner.instances, sizeof(draw_instance_t) * instance_count);
+
+    vis->draws[vis->draw_count] = (visibility_draw_t){
+        .command            = *command,
+        .viewport           = *vp,
+        .first_instance     = vis->instance_count,
+        .first_record       = vis->record_count,
+        .instance_triangles = instance_triangles,
+    };
+
+    for (u32 i = 0; i < records; ++i) {
+        vis->record_draws[vis->record_count + i] = (u16)vis->draw_count;
+    }
+
+    *first_id = vis->record_count << VISIBILITY_TRIANGLE_BITS;
+
+    vis->instance_count += instance_count;
+    vis->record_count   += (u32)records;
+    vis->draw_count++;
+
+    return true;
+}
+
+/* ----------------  Order-independent transparency -------------------- */
+
+fn void oit_resize(oit_t *oit, u32 width, u32 height)
+{
+    free(oit->accum);
+    free(oit->revealage);
+    oit->accum     = (f32 *)CHECK_PTR(calloc((size_t)width * height * 4, sizeof(f32)));
+    oit->revealage = (f32 *)CHECK_PTR(malloc(sizeof(f32) * width * height));
+    oit->width     = width;
+    oit->height    = height;
+    oit->pending   = false;
+
+    for (size_t i = 0; i < (size_t)width * height; ++i) {
+        oit->revealage[i] = 1.f;
+    }
+}
+
+/*
+    Composite the weighted average of the translucent fragments over the
+    color buffer, each pixel keeps as much of what is under it as they
+    revealed, then empty the buffers for the next draws. Rows are independent
+    and resolved in parallel
+*/
+fn void oit_resolve(framebuffer_t const *fb)
+{
+    oit_t *oit = fb->oit;
+
+    if (!oit->pending) {
+        return;
+    }
+
+    image_view_t const *color = fb->color;
 
-        // is it counter-clockwise
-        bool const ccw = det012 < 0.f;
+    u32 const width  = MIN(oit->width,  color->width);
+    u32 const height = MIN(oit->height, color->height);
+
+    #pragma omp parallel for schedule(dynamic, 16) num_threads(binner.thread_count)
+    for (i32 y = 0; y < (i32)height; ++y)
+    {
+        __m128 const zero = _mm_setzero_ps();
+        __m128 const one  = _mm_set1_ps(1.f);
 
-        switch(command->cull_mode)
+        for (u32 x = 0; x < width; ++x)
         {
-            case CULL_MODE_NONE:
-                break;
-            case CULL_MODE_CW:
-                if(!ccw)
-                    continue;
-                break;
-            case CULL_MODE_CCW:
-                if(ccw)
-                    continue;
-                break;
+            size_t const i = (size_t)x + (size_t)y * oit->width;
+
+            f32 const revealage = oit->revealage[i];
+
+            if (revealage >= 1.f) {
+                continue;
+            }
+
+            __m128 const accum = _mm_loadu_ps(&oit->accum[i * 4]);
+
+            // rgb over the summed weight, composited with an alpha of one
+            __m128 const total   = _mm_max_ps(_mm_shuffle_ps(accum, accum, _MM_SHUFFLE(3, 3, 3, 3)), _mm_set1_ps(1e-5f));
+            __m128 const average = _mm_div_ps(accum, total);
+            __m128 const b1      = _mm_shuffle_ps(average, one, _MM_SHUFFLE(0, 0, 2, 2));
+            __m128 const src     = _mm_shuffle_ps(average, b1, _MM_SHUFFLE(2, 0, 1, 0));
+
+            color4_t *pixel = &COLOR_BUF_AT(color, x, (u32)y);
+
+            u32 packed;
+            memcpy(&packed, pixel, sizeof(u32));
+
+            __m128i const bytes = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((i32)packed), _mm_setzero_si128()), _mm_setzero_si128());
+            __m128  const dst   = _mm_mul_ps(_mm_cvtepi32_ps(bytes), _mm_set1_ps(1.f / 255.f));
+
+            __m128 const r   = _mm_set1_ps(revealage);
+            __m128 const out = _mm_add_ps(_mm_mul_ps(dst, r), _mm_mul_ps(_mm_min_ps(_mm_max_ps(src, zero), one), _mm_sub_ps(one, r)));
+
+            __m128i const q = _mm_cvtps_epi32(_mm_mul_ps(out, _mm_set1_ps(255.f)));
+
+            packed = (u32)_mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(q, q), _mm_setzero_si128()));
+            memcpy(pixel, &packed, sizeof(u32));
+
+            _mm_storeu_ps(&oit->accum[i * 4], zero);
+            oit->revealage[i] = 1.f;
+        }
+    }
+
+    oit->pending = false;
+}
+
+/*
+    Sort-middle rasterization: the vertex stage transforms every vertex of each
+    visible instance once, the front end assembles, clips and sets up triangles
+    in parallel and bins them into screen tiles, then each tile is rasterized by
+    a single worker so the color buffer is written without any locking.
+    Instances share one submission, so the tile pass runs once per draw
+*/
+fn void draw_mesh_batch(framebuffer_t const *fb, draw_command_t const *command, viewport_t const *vp)
+{
+    // blending needs the fragment alpha, the fixed-function kernels only write
+    // opaque pixels
+    draw_command_t blend_command;
+
+    if (command->pipeline.blend != BLEND_NONE && !command->shader) {
+        blend_command        = *command;
+        blend_command.shader = &shader_vertex_color;
+        command              = &blend_command;
+    }
+
+    mesh_t const *mesh = &command->mesh;
+
+    u32 const tri_total    = topology_triangle_count(mesh->topology, mesh->count);
+    u32 const vertex_total = mesh->meshlets ? mesh->meshlet_vertex_count :
+                             mesh->indices  ? mesh->vertex_count : mesh->count;
+
+    // the vertices, triangles and visibility ids of all instances are indexed
+    // with u32, draws with more instances than that holds go in batches
+    u64 const instance_size  = MAX3((u64)vertex_total, (u64)tri_total, (u64)mesh->meshlet_count * MESHLET_MAX_TRIANGLES);
+    u64 const instance_limit = instance_size ? UINT32_MAX / instance_size : UINT32_MAX;
+
+    if (!instance_limit) {
+        assert(!"mesh too large for a single draw");
+        return;
+    }
+
+    if (command->instance_count > instance_limit)
+    {
+        draw_command_t batch = *command;
+
+        for (u32 first = 0; first < command->instance_count; first += batch.instance_count)
+        {
+            batch.instance_count          = (u32)MIN(instance_limit, (u64)(command->instance_count - first));
+            batch.instance_transforms.ptr = ATTR_AT(command->instance_transforms, first);
+            batch.instance_colors.ptr     = command->instance_colors.ptr ? ATTR_AT(command->instance_colors, first) : NULL;
+
+            draw_mesh_batch(fb, &batch, vp);
+        }
+        return;
+    }
+
+    u32 const instance_total = MAX(command->instance_count, 1);
+
+    if (instance_total > binner.instance_capacity) {
+        free(binner.instances);
+        binner.instance_capacity = instance_total;
+        binner.instances         = (draw_instance_t *)CHECK_PTR(malloc(sizeof(draw_instance_t) * instance_total));
+    }
+
+    u32 instance_count = 0;
+
+    for (u32 i = 0; i < instance_total; ++i)
+    {
+        if (instance_setup(&binner.instances[instance_count], command, i)) {
+            instance_count++;
+        } else {
+            binner.threads[0].stats.draws_culled++;
         }
+    }
+
+    if (!instance_count) {
+        return;
+    }
+
+    // wireframes always go to the color buffer
+    framebuffer_t const *debug_fb     = fb;
+    image_view_t  const *debug_target = fb->color;
 
-        if (ccw){
-            vecf4_swap(&v1, &v2);
-            color4_swap(&c1, &c2);
-            det012 = -det012;
+    // in visibility mode the raster pass writes triangle ids with the flat
+    // kernels and leaves the colors to the resolve
+    framebuffer_t  visibility_fb;
+    draw_command_t visibility_command;
+    u32            first_id = 0;
+
+    if (fb->visibility)
+    {
+        u32 const instance_triangles = mesh->meshlets ? mesh->meshlet_count * MESHLET_MAX_TRIANGLES : tri_total;
+
+        visibility_fb = *fb;
+
+        // programmable and blended draws have no resolve of their own, they are
+        // shaded as they are rasterized once the ids before them are resolved
+        if (command->shader) {
+            visibility_resolve(fb);
+            visibility_fb.visibility = NULL;
+        } else if (visibility_record(fb, command, vp, instance_count, instance_triangles, &first_id)) {
+            visibility_fb.color = &fb->visibility->ids;
+
+            visibility_command = *command;
+            visibility_command.pipeline.interpolation = INTERPOLATION_FLAT;
+            visibility_command.pipeline.attributes    = 0;
+            command = &visibility_command;
+        } else {
+            visibility_fb.visibility = NULL;
         }
+        fb = &visibility_fb;
+    }
+
+    u32 const batch_total  = (vertex_total + VERTEX_BATCH - 1) / VERTEX_BATCH;
+
+    // every visible instance gets its own range of post-transform vertices
+    u64 const vertex_count = (u64)vertex_total * instance_count;
+
+    if (vertex_count > binner.vertex_capacity) {
+        free(binner.vertices);
+        binner.vertex_capacity = (u32)vertex_count;
+        binner.vertices        = (post_vertex_t *)CHECK_PTR(malloc(sizeof(post_vertex_t) * binner.vertex_capacity));
+    }
 
-        // Bounding Box
-        i32 xmin = MAX(vp->xmin, 0);
-        i32 xmax = MIN(vp->xmax, (i32)color_buf->width)-1;
-        i32 ymin = MAX(vp->ymin, 0);
-        i32 ymax = MIN(vp->ymax, (i32)color_buf->height)-1;
+    for (u32 i = 0; i < instance_count; ++i) {
+        binner.instances[i].vertex_base = i * vertex_total;
+    }
+
+    // and the varyings of a programmable draw go alongside, in a buffer of their own
+    u32 const varying_count = command->shader ? command->shader->varying_count : 0;
+
+    if (vertex_count * varying_count > binner.varying_capacity) {
+        free(binner.varyings);
+        binner.varying_capacity = (size_t)(vertex_count * varying_count);
+        binner.varyings         = (f32 *)CHECK_PTR(malloc(sizeof(f32) * binner.varying_capacity));
+    }
+
+    // the depth hierarchy can only reject when this draw tests depth, and
+    // its stencil ops leave the rejected fragments alone
+    hiz_t *hiz = (fb->depth && command->pipeline.depth.test && !stencil_writes_rejected(pipeline_stencil(&command->pipeline, fb))) ?
+                 fb->depth->hiz : NULL;
+
+    vec2f_t const guard = clip_guard_band(vp);
+
+    for (u32 t = 0; t < binner.thread_count; ++t) {
+        binner.threads[t].tri_count = 0;
+    }
 
-        xmin = MAX(xmin, MIN3(floor(v0.x), floor(v1.x), floor(v2.x)));
-        xmax = MIN(xmax, MAX3(ceil(v0.x), ceil(v1.x), ceil(v2.x)));
-        ymin = MAX(ymin, MIN3(floor(v0.y), floor(v1.y), floor(v2.y)));
-        ymax = MIN(ymax, MAX3(ceil(v0.y), ceil(v1.y), ceil(v2.y)));
+    #pragma omp parallel num_threads(binner.thread_count)
+    {
+        u32 const thread_idx   = (u32)omp_get_thread_num();
+        u32 const thread_count = (u32)omp_get_num_threads();
+
+        raster_thread_t *thread = &binner.threads[thread_idx];
 
-        for (i32 y = ymin; y < ymax; ++y)
+        if (mesh->meshlets)
         {
-            for (i32 x = xmin; x < xmax; ++x)
-            {
-                // point is considered in the middle of the pixel
-                vec4f_t p = {x + 0.5f, y + 0.5f, 0.f, 0.f};     
+            // each meshlet runs its own vertex stage, so a culled meshlet costs
+            // no vertex work at all
+            u32 const total = (u32)((u64)mesh->meshlet_count * instance_count);
+            u32 const begin = (u32)(((u64)total * thread_idx) / thread_count);
+            u32 const end   = (u32)(((u64)total * (thread_idx + 1)) / thread_count);
 
-                vec4f_t v10 = vec4f_sub(&v1, &v0);
-                vec4f_t vp0 = vec4f_sub(&p, &v0);
+            for (u32 idx = begin; idx < end; ++idx)
+            {
+                draw_instance_t const *instance = &binner.instances[idx / mesh->meshlet_count];
+                meshlet_t       const *m        = &mesh->meshlets[idx % mesh->meshlet_count];
 
-                vec4f_t v21 = vec4f_sub(&v2, &v1);
-                vec4f_t vp1 = vec4f_sub(&p, &v1);
+                if (meshlet_cull(m, instance, &thread->stats)) {
+                    continue;
+                }
 
-                vec4f_t v02 = vec4f_sub(&v0, &v2);
-                vec4f_t vp2 = vec4f_sub(&p, &v2);
+                u32 const base = instance->vertex_base + m->vertex_offset;
 
-                f32 det01p = vec4f_det2D(&v10, &vp0);
-                f32 det12p = vec4f_det2D(&v21, &vp1);
-                f32 det20p = vec4f_det2D(&v02, &vp2);
+                post_vertex_t *vertices = &binner.vertices[base];
+                vertex_stage(command, instance, vp, guard, mesh->meshlet_vertices, m->vertex_offset, m->vertex_count, vertices,
+                             binner_varyings(base, varying_count));
 
-                if (det01p >= 0.0f && det12p >= 0.0f && det20p >= 0.0f)
+                for (u32 t = 0; t < m->triangle_count; ++t)
                 {
-                    f32 l0 = det12p / det012;
-                    f32 l1 = det20p / det012;
-                    f32 l2 = det01p / det012;
-
-                    color4_t final_col = {
-                        .r = c0.r * l0 + c1.r * l1 + c2.r * l2,
-                        .g = c0.g * l0 + c1.g * l1 + c2.g * l2,
-                        .b = c0.b * l0 + c1.b * l1 + c2.b * l2,
-                        .a = 255
-                    };
-                      
-                    COLOR_BUF_AT(color_buf, x, y) = final_col;
+                    u8 const *local = &mesh->meshlet_triangles[(m->triangle_offset + t) * 3];
+                    post_vertex_t const *pv[3] = {&vertices[local[0]], &vertices[local[1]], &vertices[local[2]]};
+
+                    assemble_triangle(thread, fb, command, vp, hiz, guard, pv, first_id + idx * MESHLET_MAX_TRIANGLES + t);
                 }
             }
         }
-        if(gc.debug)
+        else
         {
-            // Debug: Draw triangle edges
-            vec4f_t debug_color = {0.537f, 0.914f, 0.992f, 1.0f}; // Red color for debug lines
-            
-            // Convert to integer coordinates for line drawing
-            int x0 = (int)roundf(debug_v0.x);
-            int y0 = (int)roundf(debug_v0.y);
-            int x1 = (int)roundf(debug_v1.x);
-            int y1 = (int)roundf(debug_v1.y);
-            int x2 = (int)roundf(debug_v2.x);
-            int y2 = (int)roundf(debug_v2.y);
-            
-            // Draw all three edges of the triangle
-            draw_line(color_buf, x0, y0, x1, y1, debug_color);
-            draw_line(color_buf, x1, y1, x2, y2, debug_color);
-            draw_line(color_buf, x2, y2, x0, y0, debug_color);
+            // vertex stage: every vertex is transformed once in batches, primitives
+            // only gather the results by index
+            #pragma omp for schedule(static)
+            for (i64 b = 0; b < (i64)batch_total * instance_count; ++b)
+            {
+                draw_instance_t const *instance = &binner.instances[(u32)b / batch_total];
+
+                u32 const first = ((u32)b % batch_total) * VERTEX_BATCH;
+                vertex_stage(command, instance, vp, guard, NULL, first, MIN(VERTEX_BATCH, vertex_total - first),
+                             &binner.vertices[instance->vertex_base + first], binner_varyings(instance->vertex_base + first, varying_count));
+            }
+
+            u32 const total = (u32)((u64)tri_total * instance_count);
+            u32 const begin = (u32)(((u64)total * thread_idx) / thread_count);
+            u32 const end   = (u32)(((u64)total * (thread_idx + 1)) / thread_count);
+
+            for (u32 idx = begin; idx < end; ++idx)
+            {
+                post_vertex_t const *vertices = &binner.vertices[binner.instances[idx / tri_total].vertex_base];
+
+                u32 v[3];
+                mesh_triangle(mesh, idx % tri_total, v);
+
+                post_vertex_t const *pv[3] = {&vertices[v[0]], &vertices[v[1]], &vertices[v[2]]};
+                assemble_triangle(thread, fb, command, vp, hiz, guard, pv, first_id + idx);
+            }
+        }
+    }
+
+    rasterize_fn_t const rasterize = !command->shader           ? pipeline_kernel(&command->pipeline, fb) :
+                                     command->shader->rasterize ? command->shader->rasterize : rasterize_shaded;
+
+    if (command->pipeline.blend == BLEND_WEIGHTED_OIT && fb->oit) {
+        fb->oit->pending = true;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(binner.thread_count)
+    for (i32 tile = 0; tile < (i32)binner.tile_count; ++tile)
+    {
+        i32 const x0 = (tile % (i32)binner.tiles_x) * TILE_SIZE;
+        i32 const y0 = (tile / (i32)binner.tiles_x) * TILE_SIZE;
+        i32 const x1 = x0 + TILE_SIZE;
+        i32 const y1 = y0 + TILE_SIZE;
+
+        raster_stats_t *stats = &binner.threads[omp_get_thread_num()].stats;
+
+        for (u32 t = 0; t < binner.thread_count; ++t)
+        {
+            raster_thread_t *thread = &binner.threads[t];
+            tile_bin_t      *bin    = &thread->bins[tile];
+
+            for (u32 i = 0; i < bin->count; ++i)
+            {
+                raster_tri_t const *tri = &thread->tris[bin->items[i]];
+
+                // earlier triangles of this draw may have covered it since binning
+                if (hiz) {
+                    depth_bounds_t const z = depth_bounds_quantize(fb->depth->format, tri->z_min, tri->z_max);
+
+                    if (hiz_reject(command->pipeline.depth.compare, hiz->tiles[tile], z.min, z.max)) {
+                        stats->tiles_hiz_rejected++;
+                        continue;
+                    }
+                }
+                if (tri->coverage && !command->shader) {
+                    rasterize_small_triangle(fb, command, tri, x0, y0, x1, y1, stats);
+                } else {
+                    rasterize(fb, command, tri, x0, y0, x1, y1, stats);
+                }
+            }
+            bin->count = 0;
+        }
+    }
+
+    if(gc.debug)
+    {
+        // Debug: Draw triangle edges
+        vec4f_t debug_color = {0.537f, 0.914f, 0.992f, 1.0f}; // Red color for debug lines
+
+        // the resolve would shade the ids still in the visibility buffer over the edges
+        if (debug_fb->visibility) {
+            visibility_resolve(debug_fb);
+        }
+
+        for (u32 t = 0; t < binner.thread_count; ++t)
+        {
+            raster_thread_t const *thread = &binner.threads[t];
+
+            for (u32 i = 0; i < thread->tri_count; ++i)
+            {
+                raster_tri_t const *tri = &thread->tris[i];
+
+                // Convert to integer coordinates for line drawing
+                int x0 = (int)roundf(tri->v0.x);
+                int y0 = (int)roundf(tri->v0.y);
+                int x1 = (int)roundf(tri->v1.x);
+                int y1 = (int)roundf(tri->v1.y);
+                int x2 = (int)roundf(tri->v2.x);
+                int y2 = (int)roundf(tri->v2.y);
+
+                // Draw all three edges of the triangle
+                draw_line(debug_target, x0, y0, x1, y1, debug_color);
+                draw_line(debug_target, x1, y1, x2, y2, debug_color);
+                draw_line(debug_target, x2, y2, x0, y0, debug_color);
+            }
         }
     }
 }
 
+/*
+    Draw a mesh, its indices are checked once however many batches its
+    instances are split into
+*/
+fn void draw_mesh(framebuffer_t const *fb, draw_command_t const *command, viewport_t const *vp)
+{
+    if (!mesh_indices_valid(&command->mesh)) {
+        assert(!"indexed mesh with indices outside of vertex_count");
+        return;
+    }
+    draw_mesh_batch(fb, command, vp);
+}
+
 #define TGA_HEADER(buf,w,h,b) \
     header[2]  = 2;\
     header[12] = (w) & 0xFF;\
@@ -1205,6 +6019,164 @@ fn void export_image(image_view_t const *color_buf, const char *filename)
 
 model_t *model;
 
+/* ----------------  Command buffer -------------------- */
+
+/*
+    Sort key layout, most significant first:
+        state   blend layer, whether the draw tests stencil, then pipeline state
+                and whether the draw is programmable, draws sharing a raster
+                kernel run back to back
+        depth   view depth of the draw, so opaque draws within a state go
+                front to back and ordered blends back to front. Zero for the
+                stencil draws, which run in submission order
+        index   position of the command in the buffer, keeps the sort stable
+*/
+#define SORT_KEY_INDEX_BITS     24
+#define SORT_KEY_DEPTH_BITS     24
+#define SORT_KEY_DEPTH_SHIFT    SORT_KEY_INDEX_BITS
+#define SORT_KEY_STATE_SHIFT    (SORT_KEY_DEPTH_SHIFT + SORT_KEY_DEPTH_BITS)
+#define SORT_KEY_INDEX_MASK     ((1ull << SORT_KEY_INDEX_BITS) - 1)
+
+/*
+    Opaque draws come first, then the blends that do not depend on the order
+    and last the ones that do, which keep nothing else so depth alone sorts
+    them. Draws testing stencil can depend on each other through it, they
+    follow the others of their layer and keep nothing else either. Within a
+    layer the fields that select the raster kernel are the most significant
+    ones
+*/
+fn u64 sort_key_state(draw_command_t const *command)
+{
+    pipeline_state_t const *pipeline = &command->pipeline;
+
+    u64 const layer = pipeline->blend == BLEND_NONE ? 0 : blend_ordered(pipeline->blend) ? 2 : 1;
+
+    if (pipeline->stencil.test) {
+        return layer << 14 | 1 << 13;
+    }
+
+    if (layer == 2) {
+        return layer << 14;
+    }
+
+    u32 const depth = (u32)pipeline->depth.test | (u32)pipeline->depth.write << 1 | (u32)pipeline->depth.compare << 2;
+
+    return layer << 14 | (u64)(command->shader != NULL) << 12 | (u64)depth << 7 | (u64)pipeline->interpolation << 6 |
+           (u64)(pipeline->attributes & 0xF) << 2 | (u64)pipeline->cull_mode;
+}
+
+/*
+    Distance along the view direction of the center of the draw, its clip w.
+    Positive floats keep their order when compared as integers, the top bits
+    hold the exponent and the leading mantissa bits. Flipped for the ordered
+    blends so the far draws come first
+*/
+fn u32 sort_key_depth(draw_command_t const *command)
+{
+    if (command->pipeline.stencil.test) {
+        return 0;
+    }
+
+    mat4x4_t transform = command->transform;
+
+    if (command->instance_count) {
+        mat4x4_t const *model = (mat4x4_t const *)ATTR_AT(command->instance_transforms, 0);
+        transform = mat4x4_mult(model, &command->transform);
+    }
+
+    vec3f_t const center = command->mesh.bounds ? command->mesh.bounds->center : (vec3f_t){0.f, 0.f, 0.f};
+    vec4f_t const p      = vecf4_as_point(&center);
+    vec4f_t const clip   = vec4f_mat_mul(&transform, &p);
+
+    if (!(clip.w > 0.f)) {
+        return 0;
+    }
+
+    u32 bits;
+    memcpy(&bits, &clip.w, sizeof(bits));
+    bits >>= 32 - SORT_KEY_DEPTH_BITS;
+
+    return blend_ordered(command->pipeline.blend) ? ~bits & ((1u << SORT_KEY_DEPTH_BITS) - 1) : bits;
+}
+
+fn void command_buffer_push(command_buffer_t *cb, draw_command_t const *command)
+{
+    if (cb->count >= cb->capacity) {
+        cb->capacity = cb->capacity ? cb->capacity * 2 : 64;
+        cb->commands = (draw_command_t *)CHECK_PTR(realloc(cb->commands, sizeof(draw_command_t) * cb->capacity));
+        cb->keys     = (u64 *)CHECK_PTR(realloc(cb->keys, sizeof(u64) * cb->capacity));
+        cb->scratch  = (u64 *)CHECK_PTR(realloc(cb->scratch, sizeof(u64) * cb->capacity));
+    }
+
+    cb->commands[cb->count] = *command;
+    cb->keys[cb->count]     = sort_key_state(command)           << SORT_KEY_STATE_SHIFT |
+                              (u64)sort_key_depth(command)       << SORT_KEY_DEPTH_SHIFT |
+                              (cb->count & SORT_KEY_INDEX_MASK);
+    cb->count++;
+}
+
+/*
+    Least significant digit radix sort, one byte per pass. Passes where every
+    key has the same byte are skipped, which drops most of them for the
+    small state field and the index bits of short buffers
+*/
+fn void radix_sort_u64(u64 *keys, u64 *scratch, u32 count)
+{
+    u64 *src = keys;
+    u64 *dst = scratch;
+
+    for (u32 shift = 0; shift < 64; shift += 8)
+    {
+        u32 offsets[256] = {0};
+
+        for (u32 i = 0; i < count; ++i) {
+            offsets[(src[i] >> shift) & 0xFF]++;
+        }
+
+        if (offsets[(src[0] >> shift) & 0xFF] == count) {
+            continue;
+        }
+
+        u32 sum = 0;
+
+        for (u32 d = 0; d < 256; ++d)
+        {
+            u32 const n = offsets[d];
+            offsets[d]  = sum;
+            sum        += n;
+        }
+
+        for (u32 i = 0; i < count; ++i) {
+            dst[offsets[(src[i] >> shift) & 0xFF]++] = src[i];
+        }
+
+        u64 *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != keys) {
+        memcpy(keys, src, sizeof(u64) * count);
+    }
+}
+
+/*
+    Sort the frame draws by key and execute them, the buffer is empty afterwards
+*/
+fn void command_buffer_execute(command_buffer_t *cb, framebuffer_t const *fb, viewport_t const *vp)
+{
+    if (!cb->count) {
+        return;
+    }
+
+    radix_sort_u64(cb->keys, cb->scratch, cb->count);
+
+    for (u32 i = 0; i < cb->count; ++i) {
+        draw_mesh(fb, &cb->commands[cb->keys[i] & SORT_KEY_INDEX_MASK], vp);
+    }
+    cb->count = 0;
+}
+
 fn void render_all(void)
 {
     curr_time += gc.dt;
@@ -1215,9 +6187,46 @@ fn void render_all(void)
         gc.draw_buffer.pixels = (color4_t *)draw_surface->pixels;
         gc.draw_buffer.height = gc.screen_height;
         gc.draw_buffer.width  = gc.screen_width;
+        depth_view_resize(&gc.depth_buffer, gc.screen_width, gc.screen_height);
+        stencil_view_resize(&gc.stencil_buffer, gc.screen_width, gc.screen_height);
+        visibility_resize(&gc.visibility, gc.screen_width, gc.screen_height);
+        oit_resize(&gc.oit, gc.screen_width, gc.screen_height);
+        binner_resize(&binner, gc.screen_width, gc.screen_height);
     }
     
     clear_screen(&gc.draw_buffer, (color4_t){40.f, 42.f, 54.f, 255.f});
+    clear_depth(&gc.depth_buffer);
+    clear_stencil(&gc.stencil_buffer, 0);
+    raster_stats_reset(&binner);
+
+    framebuffer_t fb = {
+        .color      = &gc.draw_buffer,
+        .depth      = &gc.depth_buffer,
+        .stencil    = &gc.stencil_buffer,
+        .visibility = gc.deferred ? &gc.visibility : NULL,
+        .oit        = &gc.oit,
+    };
+
+    pipeline_state_t pipeline = {
+        .cull_mode = CULL_MODE_CW,
+        .depth = {
+            .test    = true,
+            .write   = true,
+            .compare = gc.depth_buffer.reverse_z ? COMPARE_GREATER : COMPARE_LESS,
+        },
+        .interpolation = INTERPOLATION_PERSPECTIVE,
+        .attributes = ATTRIBUTE_COLOR,
+    };
+
+    // one translucent instance, the oit buffers composite its surfaces in any order
+    mat4x4_t const ghost_transform = mat_identity();
+    color4_t const ghost_color     = {255, 255, 255, 112};
+
+    if (gc.transparent) {
+        pipeline.cull_mode   = CULL_MODE_NONE;
+        pipeline.depth.write = false;
+        pipeline.blend       = BLEND_WEIGHTED_OIT;
+    }
     // draw_triangle(&gc.draw_buffer,(Point){100,100},(Point){200,100}, (Point){100,200});
 
     viewport_t vp = {
@@ -1233,7 +6242,16 @@ fn void render_all(void)
     mat4x4_t scale       = mat_scale_const(1.f);
     mat4x4_t rotatezx    = mat_rotate_zx(curr_time);
     mat4x4_t rotatexy    = mat_rotate_xy(curr_time * 1.61f);
-    mat4x4_t perspective = mat_perspective(0.01f, 10.f, (f32)(M_PI / 3.f), (f32)gc.screen_width * 1.0f / (f32)gc.screen_height);
+    f32 const z_near = 0.01f;
+    f32 const z_far  = 10.f;
+
+    mat4x4_t perspective = gc.depth_buffer.reverse_z ?
+                           mat_perspective_reverse_z(z_near, z_far, (f32)(M_PI / 3.f), (f32)gc.screen_width * 1.0f / (f32)gc.screen_height) :
+                           mat_perspective(z_near, z_far, (f32)(M_PI / 3.f), (f32)gc.screen_width * 1.0f / (f32)gc.screen_height);
+
+    // translucent surfaces are weighted by where they fall in the view depth range
+    gc.oit.view_near = z_near;
+    gc.oit.view_far  = z_far;
     mat4x4_t translate   = mat_translate((vec3f_t){0.f, 0.f, -5.f});
 
     mat4x4_t transform = mat4x4_mult(&scale, &rotatezx);        
@@ -1241,18 +6259,36 @@ fn void render_all(void)
     transform = mat4x4_mult(&transform, &translate);            
     transform = mat4x4_mult(&transform, &perspective);          
 
+    textured_uniforms_t const cube_uniforms = {
+        .texture   = gc.texture,
+        .sampler   = {FILTER_TRILINEAR, WRAP_REPEAT},
+        .texcoords = ATTR_NEW(cube_texcoords),
+    };
+
     if (model) {
         draw_command_t cmd = {
             .mesh = {
-                .positions = ATTR_NEW(model->positions),
+                .positions = {model->quantized_positions, sizeof(vec3i16_t), ATTRIBUTE_FORMAT_SNORM16},
                 .colors = ATTR_NEW(model->colors),
                 .indices = model->indices,
                 .count = model->index_count,
+                .vertex_count = model->vertex_count,
+                .bounds = &model->bounds,
+                .position_quantization = &model->quantization,
+                .meshlets = model->meshlets,
+                .meshlet_vertices = model->meshlet_vertices,
+                .meshlet_triangles = model->meshlet_triangles,
+                .meshlet_count = model->meshlet_count,
+                .meshlet_vertex_count = model->meshlet_vertex_count,
             },
+            .pipeline = pipeline,
             .transform = transform,
-            .cull_mode = CULL_MODE_CW
+            .instance_count = gc.transparent,
+            .instance_transforms = {.ptr = &ghost_transform},
+            .instance_colors = {.ptr = &ghost_color},
+            .shader = gc.shaded ? &shader_vertex_color : NULL,
         };
-        draw_mesh(&gc.draw_buffer, &cmd, &vp);
+        command_buffer_push(&commands, &cmd);
     }
     else
     {
@@ -1261,15 +6297,31 @@ fn void render_all(void)
                 .positions = ATTR_NEW(cube_positions),
                 .colors = ATTR_NEW(cube_colors),
                 .indices = cube_indices,
-                .count = 36,
+                .index_format = INDEX_FORMAT_U8,
+                .count = sizeof(cube_indices) / sizeof(cube_indices[0]),
+                .vertex_count = sizeof(cube_positions) / sizeof(cube_positions[0]),
+                .bounds = &cube_bounds,
             },
+            .pipeline = pipeline,
             .transform = transform,
-            .cull_mode = CULL_MODE_CW
+            .instance_count = gc.transparent,
+            .instance_transforms = {.ptr = &ghost_transform},
+            .instance_colors = {.ptr = &ghost_color},
+            .shader = !gc.shaded ? NULL : gc.texture ? &shader_textured : &shader_vertex_color,
+            .uniforms = &cube_uniforms,
         };
-    
-        draw_mesh(&gc.draw_buffer, &cmd, &vp);
+        command_buffer_push(&commands, &cmd);
+    }
+
+    command_buffer_execute(&commands, &fb, &vp);
+
+    if (fb.visibility) {
+        visibility_resolve(&fb);
     }
 
+    // translucent draws are composited last, over everything opaque
+    oit_resolve(&fb);
+
     // draw_line(&gc.draw_buffer,0,0,gc.screen_width,gc.screen_height,(vec4f_t){0.0f, 0.0f, 0.5f, 1.0f});
 
     SDL_Rect rect = {
@@ -1279,6 +6331,26 @@ fn void render_all(void)
         .h = (int)gc.screen_height
     };
 
+    if(gc.debug)
+    {
+        raster_stats_t const stats = raster_stats_total(&binner);
+
+        char title[256];
+        snprintf(title, sizeof(title), "3D Renderer | draws culled %llu, meshlets culled %llu frustum %llu cone, tris %llu (%llu small), blocks %llu empty %llu full, hi-z rejected %llu tris %llu tiles %llu/%llu blocks",
+                 (unsigned long long)stats.draws_culled,
+                 (unsigned long long)stats.meshlets_frustum_culled,
+                 (unsigned long long)stats.meshlets_cone_culled,
+                 (unsigned long long)stats.tris_binned,
+                 (unsigned long long)stats.tris_small,
+                 (unsigned long long)stats.blocks_edge_rejected,
+                 (unsigned long long)stats.blocks_full,
+                 (unsigned long long)stats.tris_hiz_rejected,
+                 (unsigned long long)stats.tiles_hiz_rejected,
+                 (unsigned long long)stats.blocks_hiz_rejected,
+                 (unsigned long long)stats.blocks_tested);
+        SDL_SetWindowTitle(gc.window, title);
+    }
+
     SDL_BlitSurface(draw_surface, &rect, SDL_GetWindowSurface(gc.window), &rect);
     SDL_UpdateWindowSurface(gc.window);
 
@@ -1312,6 +6384,19 @@ fn void init_all(void)
 
     SDL_SetWindowIcon(gc.window, gc.icon);
 
+    cube_bounds = bounds_from_positions(cube_positions, sizeof(cube_positions) / sizeof(cube_positions[0]));
+
+    // the cube samples a compressed copy, decoded block by block as it is drawn.
+    // one made with --encode loads as is, otherwise the image is encoded now
+    gc.texture = texture_open("..\\Images\\icon.txbc");
+
+    if (!gc.texture) {
+        texture_t *icon = texture_load("..\\Images\\icon.png");
+
+        gc.texture = icon ? texture_encode(icon, TEXTURE_FORMAT_BC7) : NULL;
+        texture_free(icon);
+    }
+
     gc.running     = true;
     gc.resize      = true;
     gc.rescale     = true;
@@ -1321,9 +6406,15 @@ fn void init_all(void)
 
     gc.global_scale = 1;
 
+    gc.depth_buffer.format    = DEPTH_FORMAT_D32F;
+    gc.depth_buffer.reverse_z = true;
+    gc.depth_buffer.hiz       = &gc.hiz;
+
     gc.render_interval = 20;
     gc.last_render_time = 0;
 
+    raster_init();
+
     set_dark_mode(gc.window);
 }
 
@@ -1353,8 +6444,21 @@ fn f32 get_time_difference(void *last_time)
 
 int main(int argc, char* argv[])
 {   
-    (void) argv;
-    (void) argc;
+    // Main --encode image.png texture.txbc [bc1|bc3|bc7] compresses a texture and exits
+    if (argc > 1 && !strcmp(argv[1], "--encode"))
+    {
+        char const *name = argc > 4 ? argv[4] : "bc7";
+
+        texture_format_t const format = !strcmp(name, "bc1") ? TEXTURE_FORMAT_BC1 :
+                                        !strcmp(name, "bc3") ? TEXTURE_FORMAT_BC3 :
+                                        !strcmp(name, "bc7") ? TEXTURE_FORMAT_BC7 : TEXTURE_FORMAT_RGBA8;
+
+        if (argc < 4 || format == TEXTURE_FORMAT_RGBA8) {
+            fprintf(stderr, "usage: %s --encode image.png texture.txbc [bc1|bc3|bc7]\n", argv[0]);
+            return 1;
+        }
+        return texture_convert(argv[2], argv[3], format) ? 0 : 1;
+    }
 
     init_all();
 
@@ -1397,6 +6501,7 @@ int main(int argc, char* argv[])
             // SDL_Delay(FPS(60)-elapsedTime);
         // }
     }
+    texture_free(gc.texture);
     SDL_Quit();
     return 0;
 }
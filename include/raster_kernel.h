@@ -0,0 +1,730 @@
+/*
+    Triangle rasterization kernel, included once per instruction set.
+
+    The includer defines:
+        RASTER_LANES    number of pixels tested per instruction (8 or 4)
+        RASTER_NAME     name of the generated function
+        RASTER_TARGET   function attribute enabling the instruction set
+
+    Besides RASTER_NAME, which reads the pipeline state at run time, one copy
+    of the kernel is generated for every entry of RASTER_VARIANTS with the
+    state folded in as constants, and RASTER_NAME##_variants lists them in
+    that order.
+*/
+
+#ifndef RASTER_KERNEL_H_
+#define RASTER_KERNEL_H_
+    #define RASTER_CONCAT_(a,b)     a##b
+    #define RASTER_CONCAT(a,b)      RASTER_CONCAT_(a,b)
+#endif
+
+#define RASTER_STORE            RASTER_CONCAT(RASTER_NAME, _store)
+#define RASTER_DEPTH_LOAD       RASTER_CONCAT(RASTER_NAME, _depth_load)
+#define RASTER_DEPTH_STORE      RASTER_CONCAT(RASTER_NAME, _depth_store)
+#define RASTER_DEPTH_QUANTIZE   RASTER_CONCAT(RASTER_NAME, _depth_quantize)
+#define RASTER_STENCIL_LOAD     RASTER_CONCAT(RASTER_NAME, _stencil_load)
+#define RASTER_STENCIL_STORE    RASTER_CONCAT(RASTER_NAME, _stencil_store)
+#define RASTER_STENCIL_OP       RASTER_CONCAT(RASTER_NAME, _stencil_op)
+#define RASTER_COMPARE          RASTER_CONCAT(RASTER_NAME, _compare)
+#define RASTER_HIZ_UPDATE       RASTER_CONCAT(RASTER_NAME, _hiz_update)
+#define RASTER_PLANE_ROW        RASTER_CONCAT(RASTER_NAME, _plane_row)
+#define RASTER_RCP              RASTER_CONCAT(RASTER_NAME, _rcp)
+#define RASTER_BODY             RASTER_CONCAT(RASTER_NAME, _body)
+#define RASTER_TABLE            RASTER_CONCAT(RASTER_NAME, _variants)
+#define RASTER_VARIANT_NAME(test, write, compare, format, smooth) \
+    RASTER_CONCAT(RASTER_NAME, _##test##write##_##compare##_##format##_##smooth)
+
+#if RASTER_LANES == 8
+
+    #define vf_t                __m256
+    #define vi_t                __m256i
+    #define vf_set1(a)          _mm256_set1_ps(a)
+    #define vf_add(a,b)         _mm256_add_ps(a, b)
+    #define vf_sub(a,b)         _mm256_sub_ps(a, b)
+    #define vf_mul(a,b)         _mm256_mul_ps(a, b)
+    #define vf_rcp_approx(a)    _mm256_rcp_ps(a)
+    #define vf_clamp(a,lo,hi)   _mm256_min_ps(_mm256_max_ps(a, lo), hi)
+    #define vf_as_vi(a)         _mm256_castps_si256(a)
+    #define vi_to_vf(a)         _mm256_cvtepi32_ps(a)
+    #define vf_to_vi(a)         _mm256_cvttps_epi32(a)
+    #define vi_set1(a)          _mm256_set1_epi32(a)
+    #define vi_lanes()          _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)
+    #define vi_add(a,b)         _mm256_add_epi32(a, b)
+    #define vi_mul(a,b)         _mm256_mullo_epi32(a, b)
+    #define vi_loadu(p)         _mm256_loadu_si256((__m256i const *)(p))
+    #define vi_storeu(p,a)      _mm256_storeu_si256((__m256i *)(p), a)
+    #define vi_zero()           _mm256_setzero_si256()
+    #define vi_ones()           _mm256_set1_epi32(-1)
+    #define vi_or(a,b)          _mm256_or_si256(a, b)
+    #define vi_xor(a,b)         _mm256_xor_si256(a, b)
+    #define vi_cmpeq(a,b)       _mm256_cmpeq_epi32(a, b)
+    #define vi_and(a,b)         _mm256_and_si256(a, b)
+    #define vi_andnot(a,b)      _mm256_andnot_si256(a, b)
+    #define vi_cmpgt(a,b)       _mm256_cmpgt_epi32(a, b)
+    #define vi_sra(a,n)         _mm256_srai_epi32(a, n)
+    #define vi_shl(a,n)         _mm256_slli_epi32(a, n)
+    #define vi_clamp(a,lo,hi)   _mm256_min_epi32(_mm256_max_epi32(a, lo), hi)
+    #define vi_min(a,b)         _mm256_min_epi32(a, b)
+    #define vi_max(a,b)         _mm256_max_epi32(a, b)
+    #define vi_movemask(a)      _mm256_movemask_ps(_mm256_castsi256_ps(a))
+
+#elif RASTER_LANES == 4
+
+    #define vf_t                __m128
+    #define vi_t                __m128i
+    #define vf_set1(a)          _mm_set1_ps(a)
+    #define vf_add(a,b)         _mm_add_ps(a, b)
+    #define vf_sub(a,b)         _mm_sub_ps(a, b)
+    #define vf_mul(a,b)         _mm_mul_ps(a, b)
+    #define vf_rcp_approx(a)    _mm_rcp_ps(a)
+    #define vf_clamp(a,lo,hi)   _mm_min_ps(_mm_max_ps(a, lo), hi)
+    #define vf_as_vi(a)         _mm_castps_si128(a)
+    #define vi_to_vf(a)         _mm_cvtepi32_ps(a)
+    #define vf_to_vi(a)         _mm_cvttps_epi32(a)
+    #define vi_set1(a)          _mm_set1_epi32(a)
+    #define vi_lanes()          _mm_setr_epi32(0, 1, 2, 3)
+    #define vi_add(a,b)         _mm_add_epi32(a, b)
+    #define vi_mul(a,b)         _mm_mullo_epi32(a, b)
+    #define vi_loadu(p)         _mm_loadu_si128((__m128i const *)(p))
+    #define vi_storeu(p,a)      _mm_storeu_si128((__m128i *)(p), a)
+    #define vi_zero()           _mm_setzero_si128()
+    #define vi_ones()           _mm_set1_epi32(-1)
+    #define vi_or(a,b)          _mm_or_si128(a, b)
+    #define vi_xor(a,b)         _mm_xor_si128(a, b)
+    #define vi_cmpeq(a,b)       _mm_cmpeq_epi32(a, b)
+    #define vi_and(a,b)         _mm_and_si128(a, b)
+    #define vi_andnot(a,b)      _mm_andnot_si128(a, b)
+    #define vi_cmpgt(a,b)       _mm_cmpgt_epi32(a, b)
+    #define vi_sra(a,n)         _mm_srai_epi32(a, n)
+    #define vi_shl(a,n)         _mm_slli_epi32(a, n)
+    #define vi_clamp(a,lo,hi)   _mm_min_epi32(_mm_max_epi32(a, lo), hi)
+    #define vi_min(a,b)         _mm_min_epi32(a, b)
+    #define vi_max(a,b)         _mm_max_epi32(a, b)
+    #define vi_movemask(a)      _mm_movemask_ps(_mm_castsi128_ps(a))
+
+#else
+    #error "RASTER_LANES must be 8 or 4"
+#endif
+
+/*
+    Write the masked lanes of a chunk of 32 bit values, the chunk never crosses
+    the tile but can run past the right edge of the buffer
+*/
+RASTER_TARGET fn inline void RASTER_STORE(u32 *dst, vi_t value, vi_t mask, i32 x, i32 width)
+{
+#if RASTER_LANES == 8
+    (void) x;
+    (void) width;
+    _mm256_maskstore_epi32((int *)dst, mask, value);
+#else
+    if (x + RASTER_LANES <= width) {
+        __m128i old = _mm_loadu_si128((__m128i const *)dst);
+        _mm_storeu_si128((__m128i *)dst, _mm_blendv_epi8(old, value, mask));
+    } else {
+        u32 bits = (u32)vi_movemask(mask);
+        u32 lane[RASTER_LANES];
+        _mm_storeu_si128((__m128i *)lane, value);
+        for (u32 i = 0; i < RASTER_LANES; ++i) {
+            if (bits & (1u << i)) {
+                dst[i] = lane[i];
+            }
+        }
+    }
+#endif
+}
+
+/*
+    Depth values are handled as integers that order the same way as the stored
+    depth: unorm formats are widened and non-negative floats compare correctly
+    through their bit patterns
+*/
+RASTER_TARGET fn inline vi_t RASTER_DEPTH_QUANTIZE(depth_format_t format, vf_t z)
+{
+    z = vf_clamp(z, vf_set1(0.f), vf_set1(1.f));
+
+    switch (format)
+    {
+        case DEPTH_FORMAT_D16:
+            return vf_to_vi(vf_add(vf_mul(z, vf_set1(65535.f)), vf_set1(0.5f)));
+        case DEPTH_FORMAT_D24:
+            return vf_to_vi(vf_add(vf_mul(z, vf_set1(16777215.f)), vf_set1(0.5f)));
+        case DEPTH_FORMAT_D32F:
+        default:
+            return vf_as_vi(z);
+    }
+}
+
+RASTER_TARGET fn inline vi_t RASTER_DEPTH_LOAD(depth_view_t const *depth, depth_format_t format, i32 x, i32 y)
+{
+    size_t const offset = (size_t)x + (size_t)y * depth->width;
+
+    if (x + RASTER_LANES <= (i32)depth->width)
+    {
+        if (format == DEPTH_FORMAT_D16)
+        {
+            u16 const *src = (u16 const *)depth->pixels + offset;
+#if RASTER_LANES == 8
+            return _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const *)src));
+#else
+            return _mm_cvtepu16_epi32(_mm_loadl_epi64((__m128i const *)src));
+#endif
+        }
+
+        u32 const *src = (u32 const *)depth->pixels + offset;
+        vi_t value = vi_loadu(src);
+
+        return format == DEPTH_FORMAT_D24 ? vi_and(value, vi_set1(0xFFFFFF)) : value;
+    }
+
+    // the chunk runs past the right edge of the buffer
+    i32 lane[RASTER_LANES] = {0};
+
+    for (i32 i = 0; i < RASTER_LANES && x + i < (i32)depth->width; ++i)
+    {
+        switch (format)
+        {
+            case DEPTH_FORMAT_D16:  lane[i] = ((u16 const *)depth->pixels)[offset + (size_t)i];                       break;
+            case DEPTH_FORMAT_D24:  lane[i] = (i32)(((u32 const *)depth->pixels)[offset + (size_t)i] & 0xFFFFFF);   break;
+            case DEPTH_FORMAT_D32F: lane[i] = (i32)((u32 const *)depth->pixels)[offset + (size_t)i];                break;
+        }
+    }
+    return vi_loadu(lane);
+}
+
+RASTER_TARGET fn inline void RASTER_DEPTH_STORE(depth_view_t const *depth, depth_format_t format, i32 x, i32 y, vi_t value, vi_t mask)
+{
+    size_t const offset = (size_t)x + (size_t)y * depth->width;
+
+    if (x + RASTER_LANES <= (i32)depth->width)
+    {
+        if (format == DEPTH_FORMAT_D16)
+        {
+            u16 *dst = (u16 *)depth->pixels + offset;
+#if RASTER_LANES == 8
+            __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+            __m128i mask16 = _mm_packs_epi32(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+            __m128i old    = _mm_loadu_si128((__m128i const *)dst);
+            _mm_storeu_si128((__m128i *)dst, _mm_blendv_epi8(old, packed, mask16));
+#else
+            __m128i packed = _mm_packus_epi32(value, value);
+            __m128i mask16 = _mm_packs_epi32(mask, mask);
+            __m128i old    = _mm_loadl_epi64((__m128i const *)dst);
+            _mm_storel_epi64((__m128i *)dst, _mm_blendv_epi8(old, packed, mask16));
+#endif
+            return;
+        }
+
+        u32 *dst = (u32 *)depth->pixels + offset;
+
+        if (format == DEPTH_FORMAT_D24) {
+            // the upper byte is left untouched
+            vi_t old = vi_loadu(dst);
+            value = vi_or(vi_andnot(vi_set1(0xFFFFFF), old), value);
+        }
+        RASTER_STORE(dst, value, mask, x, (i32)depth->width);
+        return;
+    }
+
+    i32 lane[RASTER_LANES];
+    vi_storeu(lane, value);
+    u32 const bits = (u32)vi_movemask(mask);
+
+    for (i32 i = 0; i < RASTER_LANES && x + i < (i32)depth->width; ++i)
+    {
+        if (!(bits & (1u << i))) {
+            continue;
+        }
+        switch (format)
+        {
+            case DEPTH_FORMAT_D16:  ((u16 *)depth->pixels)[offset + (size_t)i] = (u16)lane[i];  break;
+            case DEPTH_FORMAT_D24:{
+                u32 *dst = (u32 *)depth->pixels + offset + (size_t)i;
+                *dst = (*dst & 0xFF000000) | (u32)lane[i];
+            }break;
+            case DEPTH_FORMAT_D32F: ((u32 *)depth->pixels)[offset + (size_t)i] = (u32)lane[i];  break;
+        }
+    }
+}
+
+/*
+    Stencil values widened to one per lane
+*/
+RASTER_TARGET fn inline vi_t RASTER_STENCIL_LOAD(stencil_view_t const *stencil, i32 x, i32 y)
+{
+    u8 const *src = stencil->pixels + (size_t)x + (size_t)y * stencil->width;
+
+    if (x + RASTER_LANES <= (i32)stencil->width)
+    {
+#if RASTER_LANES == 8
+        return _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)src));
+#else
+        i32 packed;
+        memcpy(&packed, src, sizeof(packed));
+        return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+#endif
+    }
+
+    // the chunk runs past the right edge of the buffer
+    i32 lane[RASTER_LANES] = {0};
+
+    for (i32 i = 0; i < RASTER_LANES && x + i < (i32)stencil->width; ++i) {
+        lane[i] = src[i];
+    }
+    return vi_loadu(lane);
+}
+
+RASTER_TARGET fn inline void RASTER_STENCIL_STORE(stencil_view_t const *stencil, i32 x, i32 y, vi_t value, vi_t mask)
+{
+    u8 *dst = stencil->pixels + (size_t)x + (size_t)y * stencil->width;
+
+    if (x + RASTER_LANES <= (i32)stencil->width)
+    {
+#if RASTER_LANES == 8
+        __m128i const packed = _mm_packus_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+        __m128i const mask16 = _mm_packs_epi32(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+        __m128i const old    = _mm_loadl_epi64((__m128i const *)dst);
+        _mm_storel_epi64((__m128i *)dst, _mm_blendv_epi8(old, _mm_packus_epi16(packed, packed), _mm_packs_epi16(mask16, mask16)));
+#else
+        __m128i const packed = _mm_packus_epi32(value, value);
+        __m128i const mask16 = _mm_packs_epi32(mask, mask);
+
+        i32 old;
+        memcpy(&old, dst, sizeof(old));
+
+        i32 const bytes = _mm_cvtsi128_si32(_mm_blendv_epi8(_mm_cvtsi32_si128(old), _mm_packus_epi16(packed, packed), _mm_packs_epi16(mask16, mask16)));
+        memcpy(dst, &bytes, sizeof(bytes));
+#endif
+        return;
+    }
+
+    i32 lane[RASTER_LANES];
+    vi_storeu(lane, value);
+    u32 const bits = (u32)vi_movemask(mask);
+
+    for (i32 i = 0; i < RASTER_LANES && x + i < (i32)stencil->width; ++i)
+    {
+        if (bits & (1u << i)) {
+            dst[i] = (u8)lane[i];
+        }
+    }
+}
+
+RASTER_TARGET fn inline vi_t RASTER_STENCIL_OP(stencil_op_t op, vi_t value, vi_t reference)
+{
+    switch (op)
+    {
+        case STENCIL_OP_ZERO:               return vi_zero();
+        case STENCIL_OP_REPLACE:            return reference;
+        case STENCIL_OP_INCREMENT_CLAMP:    return vi_min(vi_add(value, vi_set1(1)), vi_set1(255));
+        case STENCIL_OP_DECREMENT_CLAMP:    return vi_max(vi_add(value, vi_set1(-1)), vi_zero());
+        case STENCIL_OP_INVERT:             return vi_xor(value, vi_set1(0xFF));
+        case STENCIL_OP_INCREMENT_WRAP:     return vi_and(vi_add(value, vi_set1(1)), vi_set1(0xFF));
+        case STENCIL_OP_DECREMENT_WRAP:     return vi_and(vi_add(value, vi_set1(-1)), vi_set1(0xFF));
+        case STENCIL_OP_KEEP:
+        default:                            return value;
+    }
+}
+
+/*
+    Reciprocal refined with one Newton-Raphson step, close to full precision
+*/
+RASTER_TARGET fn inline vf_t RASTER_RCP(vf_t a)
+{
+    vf_t const r = vf_rcp_approx(a);
+    return vf_mul(r, vf_sub(vf_set1(2.f), vf_mul(a, r)));
+}
+
+/*
+    Plane values of the first chunk of a row, (dx, dy) is the pixel offset of
+    its first lane from the origin of the plane
+*/
+RASTER_TARGET fn inline vf_t RASTER_PLANE_ROW(plane_t const *p, i32 dx, i32 dy)
+{
+    vf_t const lanes = vi_to_vf(vi_lanes());
+    return vf_add(vf_set1(p->origin + p->dx * (f32)dx + p->dy * (f32)dy), vf_mul(vf_set1(p->dx), lanes));
+}
+
+/*
+    Lanes where the incoming value a passes the comparison against b
+*/
+RASTER_TARGET fn inline vi_t RASTER_COMPARE(compare_op_t op, vi_t a, vi_t b)
+{
+    switch (op)
+    {
+        case COMPARE_NEVER:         return vi_zero();
+        case COMPARE_LESS:          return vi_cmpgt(b, a);
+        case COMPARE_EQUAL:         return vi_cmpeq(a, b);
+        case COMPARE_LESS_EQUAL:    return vi_xor(vi_cmpgt(a, b), vi_ones());
+        case COMPARE_GREATER:       return vi_cmpgt(a, b);
+        case COMPARE_NOT_EQUAL:     return vi_xor(vi_cmpeq(a, b), vi_ones());
+        case COMPARE_GREATER_EQUAL: return vi_xor(vi_cmpgt(b, a), vi_ones());
+        case COMPARE_ALWAYS:
+        default:                    return vi_ones();
+    }
+}
+
+/*
+    Recompute the exact bounds of the 8x8 block at (bx, by) from the depth buffer
+*/
+RASTER_TARGET fn void RASTER_HIZ_UPDATE(depth_view_t const *depth, i32 bx, i32 by)
+{
+    hiz_t *hiz = depth->hiz;
+
+    i32 const bw = MIN(bx + HIZ_BLOCK_SIZE, (i32)depth->width);
+    i32 const bh = MIN(by + HIZ_BLOCK_SIZE, (i32)depth->height);
+
+    vi_t const lanes = vi_lanes();
+    vi_t const edge  = vi_set1(bw);
+    vi_t const lo    = vi_set1(INT32_MAX);
+    vi_t const hi    = vi_set1(INT32_MIN);
+
+    vi_t vmin = lo;
+    vi_t vmax = hi;
+
+    for (i32 y = by; y < bh; ++y)
+    {
+        for (i32 x = bx; x < bw; x += RASTER_LANES)
+        {
+            vi_t const value = RASTER_DEPTH_LOAD(depth, depth->format, x, y);
+            vi_t const valid = vi_cmpgt(edge, vi_add(vi_set1(x), lanes));
+
+            vmin = vi_min(vmin, vi_or(vi_and(valid, value), vi_andnot(valid, lo)));
+            vmax = vi_max(vmax, vi_or(vi_and(valid, value), vi_andnot(valid, hi)));
+        }
+    }
+
+    i32 mins[RASTER_LANES];
+    i32 maxs[RASTER_LANES];
+    vi_storeu(mins, vmin);
+    vi_storeu(maxs, vmax);
+
+    depth_bounds_t bounds = {mins[0], maxs[0]};
+
+    for (i32 i = 1; i < RASTER_LANES; ++i) {
+        bounds.min = MIN(bounds.min, mins[i]);
+        bounds.max = MAX(bounds.max, maxs[i]);
+    }
+    hiz->blocks[(u32)(bx >> HIZ_BLOCK_SIZE_LOG2) + (u32)(by >> HIZ_BLOCK_SIZE_LOG2) * hiz->blocks_x] = bounds;
+}
+
+/*
+    Integer edge functions are set up once per triangle, the clipped bounding
+    box is walked in 8x8 blocks that are classified from their corners as
+    empty, fully covered or partial, and that the depth hierarchy can skip.
+    Inside a partial block each row evaluates the edges at its first chunk
+    and then steps them by RASTER_LANES pixels. A pixel is covered when none
+    of the three has its sign bit set.
+
+    The stencil test narrows the same lane mask before the depth test, and
+    the ops of the three outcomes are merged into one store per chunk.
+
+    The state arguments are constants in every specialized kernel, so the
+    branches on them disappear from the loops. depth_test implies a depth
+    buffer and stencil, only given when it tests, a stencil buffer
+*/
+RASTER_TARGET fn FORCE_INLINE void RASTER_BODY(framebuffer_t const *fb, raster_tri_t const *tri, i32 x0, i32 y0, i32 x1, i32 y1, raster_stats_t *stats,
+                                               bool depth_test, bool depth_write, compare_op_t compare, depth_format_t format, bool smooth,
+                                               stencil_state_t const *stencil)
+{
+    image_view_t   const *color_buf   = fb->color;
+    depth_view_t   const *depth_buf   = fb->depth;
+    stencil_view_t const *stencil_buf = fb->stencil;
+
+    hiz_t *hiz = depth_test ? depth_buf->hiz : NULL;
+    bool const hiz_cull = hiz && !stencil_writes_rejected(stencil);
+
+    bool const stencil_write = stencil && stencil->write_mask &&
+                               (stencil->fail != STENCIL_OP_KEEP || stencil->depth_fail != STENCIL_OP_KEEP || stencil->pass != STENCIL_OP_KEEP);
+
+    i32 const xmin = MAX(x0, tri->xmin);
+    i32 const xmax = MIN(x1, tri->xmax);
+    i32 const ymin = MAX(y0, tri->ymin);
+    i32 const ymax = MIN(y1, tri->ymax);
+
+    vi_t const lanes = vi_lanes();
+
+    vi_t const lane0 = vi_mul(vi_set1(tri->edge_a[0]), lanes);
+    vi_t const lane1 = vi_mul(vi_set1(tri->edge_a[1]), lanes);
+    vi_t const lane2 = vi_mul(vi_set1(tri->edge_a[2]), lanes);
+
+    vi_t const step0 = vi_set1(tri->edge_a[0] * RASTER_LANES);
+    vi_t const step1 = vi_set1(tri->edge_a[1] * RASTER_LANES);
+    vi_t const step2 = vi_set1(tri->edge_a[2] * RASTER_LANES);
+
+    // lanes outside of [xmin, xmax) are masked off
+    vi_t const lane_min = vi_set1(xmin - 1);
+    vi_t const lane_max = vi_set1(xmax);
+
+    // planes are stepped by whole chunks along a row
+    vf_t const z_step  = vf_set1(tri->z.dx * RASTER_LANES);
+    vf_t const iw_step = vf_set1(tri->inv_w.dx * RASTER_LANES);
+    vf_t const r_step  = vf_set1(tri->color[0].dx * RASTER_LANES);
+    vf_t const g_step  = vf_set1(tri->color[1].dx * RASTER_LANES);
+    vf_t const b_step  = vf_set1(tri->color[2].dx * RASTER_LANES);
+
+    vi_t const lo    = vi_set1(0);
+    vi_t const hi    = vi_set1(255);
+    vi_t const alpha = vi_set1((i32)0xFF000000);
+    vi_t const flat  = vi_set1((i32)tri->flat_color);
+
+    vi_t const stencil_ref   = vi_set1(stencil ? stencil->reference : 0);
+    vi_t const stencil_read  = vi_set1(stencil ? stencil->read_mask : 0);
+    vi_t const stencil_keep  = vi_set1(stencil ? (u8)~stencil->write_mask : 0);    // bits the ops cannot change
+    vi_t const stencil_cmp   = vi_and(stencil_ref, stencil_read);
+
+    bool tile_written = false;
+
+    // blocks are aligned to the screen so they match the hierarchy, a tile
+    // holds a whole number of them
+    for (i32 by = ymin & ~(HIZ_BLOCK_SIZE - 1); by < ymax; by += HIZ_BLOCK_SIZE)
+    {
+        i32 const bymin = MAX(by, ymin);
+        i32 const bymax = MIN(by + HIZ_BLOCK_SIZE, ymax);
+
+        for (i32 bx = xmin & ~(HIZ_BLOCK_SIZE - 1); bx < xmax; bx += HIZ_BLOCK_SIZE)
+        {
+            i32 const bxmin = MAX(bx, xmin);
+            i32 const bxmax = MIN(bx + HIZ_BLOCK_SIZE, xmax);
+
+            // edge functions are linear so they are extreme at the corners of the
+            // clipped block, all inside means no pixel of the block needs the edge
+            // test, any edge outside everywhere means the block is empty
+            bool full = true;
+            bool empty = false;
+
+            for (u32 i = 0; i < 3; ++i)
+            {
+                i32 const e  = tri->edge_c[i] + tri->edge_a[i] * (bxmin - tri->xmin) + tri->edge_b[i] * (bymin - tri->ymin);
+                i32 const ex = tri->edge_a[i] * (bxmax - 1 - bxmin);
+                i32 const ey = tri->edge_b[i] * (bymax - 1 - bymin);
+
+                full  = full  && e + MIN(ex, 0) + MIN(ey, 0) >= 0;
+                empty = empty || e + MAX(ex, 0) + MAX(ey, 0) < 0;
+            }
+
+            if (empty) {
+                stats->blocks_edge_rejected++;
+                continue;
+            }
+            stats->blocks_full += full;
+
+            if (hiz_cull)
+            {
+                stats->blocks_tested++;
+
+                // the plane is extreme at the corners of the clipped block
+                f32 const z  = tri->z.origin + tri->z.dx * (f32)(bxmin - tri->xmin) + tri->z.dy * (f32)(bymin - tri->ymin);
+                f32 const ex = tri->z.dx * (f32)(bxmax - 1 - bxmin);
+                f32 const ey = tri->z.dy * (f32)(bymax - 1 - bymin);
+
+                f32 const zlo = MAX(z + MIN(ex, 0.f) + MIN(ey, 0.f), tri->z_min);
+                f32 const zhi = MIN(z + MAX(ex, 0.f) + MAX(ey, 0.f), tri->z_max);
+
+                depth_bounds_t const q = depth_bounds_quantize(format, zlo, zhi);
+                depth_bounds_t const stored = hiz->blocks[(u32)(bx >> HIZ_BLOCK_SIZE_LOG2) + (u32)(by >> HIZ_BLOCK_SIZE_LOG2) * hiz->blocks_x];
+
+                if (hiz_reject(compare, stored, q.min, q.max)) {
+                    stats->blocks_hiz_rejected++;
+                    continue;
+                }
+            }
+
+            // chunks stay aligned to the block so they never touch a neighbouring tile
+            i32 const xstart = bx + ((bxmin - bx) & ~(RASTER_LANES - 1));
+            i32 const dx     = xstart - tri->xmin;
+
+            bool written = false;
+
+            for (i32 y = bymin; y < bymax; ++y)
+            {
+                i32 const dy = y - tri->ymin;
+
+                vi_t e0 = vi_add(vi_set1(tri->edge_c[0] + tri->edge_a[0] * dx + tri->edge_b[0] * dy), lane0);
+                vi_t e1 = vi_add(vi_set1(tri->edge_c[1] + tri->edge_a[1] * dx + tri->edge_b[1] * dy), lane1);
+                vi_t e2 = vi_add(vi_set1(tri->edge_c[2] + tri->edge_a[2] * dx + tri->edge_b[2] * dy), lane2);
+
+                vi_t xs = vi_add(vi_set1(xstart), lanes);
+
+                vf_t z  = RASTER_PLANE_ROW(&tri->z, dx, dy);
+                vf_t iw = RASTER_PLANE_ROW(&tri->inv_w, dx, dy);
+                vf_t rw = RASTER_PLANE_ROW(&tri->color[0], dx, dy);
+                vf_t gw = RASTER_PLANE_ROW(&tri->color[1], dx, dy);
+                vf_t bw = RASTER_PLANE_ROW(&tri->color[2], dx, dy);
+
+                color4_t *row = &COLOR_BUF_AT(color_buf, 0, y);
+
+                for (i32 x = xstart; x < bxmax; x += RASTER_LANES)
+                {
+                    vi_t mask = vi_and(vi_cmpgt(xs, lane_min), vi_cmpgt(lane_max, xs));
+
+                    if (!full) {
+                        mask = vi_andnot(vi_sra(vi_or(vi_or(e0, e1), e2), 31), mask);
+                    }
+
+                    vi_t const covered = mask;
+                    vi_t stored        = vi_zero();
+
+                    if (stencil && vi_movemask(mask)) {
+                        stored = RASTER_STENCIL_LOAD(stencil_buf, x, y);
+                        mask   = vi_and(mask, RASTER_COMPARE(stencil->compare, stencil_cmp, vi_and(stored, stencil_read)));
+                    }
+
+                    vi_t const stencil_pass = mask;
+
+                    if (depth_test && vi_movemask(mask))
+                    {
+                        vi_t qz = RASTER_DEPTH_QUANTIZE(format, z);
+
+                        mask = vi_and(mask, RASTER_COMPARE(compare, qz, RASTER_DEPTH_LOAD(depth_buf, format, x, y)));
+
+                        if (depth_write && vi_movemask(mask)) {
+                            RASTER_DEPTH_STORE(depth_buf, format, x, y, qz, mask);
+                            written = true;
+                        }
+                    }
+
+                    if (stencil_write && vi_movemask(covered))
+                    {
+                        vi_t const fail       = vi_andnot(stencil_pass, covered);
+                        vi_t const depth_fail = vi_andnot(mask, stencil_pass);
+
+                        vi_t value = RASTER_STENCIL_OP(stencil->pass, stored, stencil_ref);
+
+                        if (vi_movemask(depth_fail)) {
+                            value = vi_or(vi_and(depth_fail, RASTER_STENCIL_OP(stencil->depth_fail, stored, stencil_ref)), vi_andnot(depth_fail, value));
+                        }
+                        if (vi_movemask(fail)) {
+                            value = vi_or(vi_and(fail, RASTER_STENCIL_OP(stencil->fail, stored, stencil_ref)), vi_andnot(fail, value));
+                        }
+
+                        value = vi_or(vi_and(stored, stencil_keep), vi_andnot(stencil_keep, value));
+                        RASTER_STENCIL_STORE(stencil_buf, x, y, value, covered);
+                    }
+
+                    if (vi_movemask(mask))
+                    {
+                        vi_t color = flat;
+
+                        if (smooth)
+                        {
+                            // one reciprocal per pixel makes the attributes perspective correct
+                            vf_t const w = RASTER_RCP(iw);
+
+                            vi_t r = vi_clamp(vf_to_vi(vf_mul(rw, w)), lo, hi);
+                            vi_t g = vi_clamp(vf_to_vi(vf_mul(gw, w)), lo, hi);
+                            vi_t b = vi_clamp(vf_to_vi(vf_mul(bw, w)), lo, hi);
+
+                            color = vi_or(vi_or(r, vi_shl(g, 8)), vi_or(vi_shl(b, 16), alpha));
+                        }
+
+                        RASTER_STORE((u32 *)&row[x], color, mask, x, (i32)color_buf->width);
+                    }
+
+                    e0 = vi_add(e0, step0);
+                    e1 = vi_add(e1, step1);
+                    e2 = vi_add(e2, step2);
+                    xs = vi_add(xs, vi_set1(RASTER_LANES));
+                    z  = vf_add(z, z_step);
+                    iw = vf_add(iw, iw_step);
+                    rw = vf_add(rw, r_step);
+                    gw = vf_add(gw, g_step);
+                    bw = vf_add(bw, b_step);
+                }
+            }
+
+            if (hiz && written) {
+                RASTER_HIZ_UPDATE(depth_buf, bx, by);
+                tile_written = true;
+            }
+        }
+    }
+
+    if (tile_written) {
+        hiz_update_tile(hiz, (u32)x0 >> TILE_SIZE_LOG2, (u32)y0 >> TILE_SIZE_LOG2);
+    }
+}
+
+/*
+    Generic kernel for the states without a specialized one
+*/
+RASTER_TARGET fn void RASTER_NAME(framebuffer_t const *fb, draw_command_t const *command, raster_tri_t const *tri, i32 x0, i32 y0, i32 x1, i32 y1, raster_stats_t *stats)
+{
+    pipeline_state_t const *pipeline = &command->pipeline;
+
+    bool const depth_test  = fb->depth && pipeline->depth.test;
+    bool const depth_write = depth_test && pipeline->depth.write;
+
+    RASTER_BODY(fb, tri, x0, y0, x1, y1, stats, depth_test, depth_write, pipeline->depth.compare,
+                depth_test ? fb->depth->format : DEPTH_FORMAT_D32F, pipeline_smooth(pipeline), pipeline_stencil(pipeline, fb));
+}
+
+#define RASTER_DEFINE_VARIANT(test, write, compare, format, smooth)                                     \
+    RASTER_TARGET fn void RASTER_VARIANT_NAME(test, write, compare, format, smooth)(                    \
+        framebuffer_t const *fb, draw_command_t const *command, raster_tri_t const *tri,                \
+        i32 x0, i32 y0, i32 x1, i32 y1, raster_stats_t *stats)                                          \
+    {                                                                                                   \
+        (void) command;                                                                                 \
+        RASTER_BODY(fb, tri, x0, y0, x1, y1, stats, test, write, COMPARE_##compare, DEPTH_FORMAT_##format, smooth, NULL); \
+    }
+
+#define RASTER_LIST_VARIANT(test, write, compare, format, smooth) \
+    RASTER_VARIANT_NAME(test, write, compare, format, smooth),
+
+RASTER_VARIANTS(RASTER_DEFINE_VARIANT)
+
+global_variable rasterize_fn_t const RASTER_TABLE[RASTER_VARIANT_COUNT] = {
+    RASTER_VARIANTS(RASTER_LIST_VARIANT)
+};
+
+#undef RASTER_DEFINE_VARIANT
+#undef RASTER_LIST_VARIANT
+
+#undef vf_t
+#undef vi_t
+#undef vf_set1
+#undef vf_add
+#undef vf_sub
+#undef vf_mul
+#undef vf_rcp_approx
+#undef vi_to_vf
+#undef vf_to_vi
+#undef vf_clamp
+#undef vf_as_vi
+#undef vi_loadu
+#undef vi_storeu
+#undef vi_zero
+#undef vi_ones
+#undef vi_xor
+#undef vi_cmpeq
+#undef vi_set1
+#undef vi_lanes
+#undef vi_add
+#undef vi_mul
+#undef vi_or
+#undef vi_and
+#undef vi_andnot
+#undef vi_cmpgt
+#undef vi_sra
+#undef vi_shl
+#undef vi_clamp
+#undef vi_min
+#undef vi_max
+#undef vi_movemask
+
+#undef RASTER_STORE
+#undef RASTER_DEPTH_LOAD
+#undef RASTER_DEPTH_STORE
+#undef RASTER_DEPTH_QUANTIZE
+#undef RASTER_STENCIL_LOAD
+#undef RASTER_STENCIL_STORE
+#undef RASTER_STENCIL_OP
+#undef RASTER_COMPARE
+#undef RASTER_HIZ_UPDATE
+#undef RASTER_PLANE_ROW
+#undef RASTER_RCP
+#undef RASTER_BODY
+#undef RASTER_TABLE
+#undef RASTER_VARIANT_NAME
+#undef RASTER_LANES
+#undef RASTER_NAME
+#undef RASTER_TARGET
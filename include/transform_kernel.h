@@ -0,0 +1,270 @@
+/*
+    Batched position transform, included once per instruction set.
+
+    The includer defines:
+        TRANSFORM_LANES     number of vertices transformed per instruction (16, 8 or 4)
+        TRANSFORM_NAME      name of the generated function
+        TRANSFORM_TARGET    function attribute enabling the instruction set
+
+    Positions are read from a strided attribute, directly or through an index
+    list, deinterleaved into lanes and written out as structure of arrays.
+    Formats narrower than 32 bits are gathered as whole 32 bit words and
+    unpacked in the lanes. Integer formats are converted to floats as they
+    are, their normalization is left to the matrix.
+*/
+
+#define TRANSFORM_CONCAT_(a, b)     a##b
+#define TRANSFORM_CONCAT(a, b)      TRANSFORM_CONCAT_(a, b)
+#define TRANSFORM_HALF              TRANSFORM_CONCAT(TRANSFORM_NAME, _half)
+#define TRANSFORM_LOAD              TRANSFORM_CONCAT(TRANSFORM_NAME, _load)
+
+#if TRANSFORM_LANES == 16
+
+    #define vf_t                    __m512
+    #define vi_t                    __m512i
+    #define vf_set1(a)              _mm512_set1_ps(a)
+    #define vf_fmadd(a,b,c)         _mm512_fmadd_ps(a, b, c)
+    #define vf_storeu(p,a)          _mm512_storeu_ps(p, a)
+    #define vi_set1(a)              _mm512_set1_epi32(a)
+    #define vi_lanes()              _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+    #define vi_add(a,b)             _mm512_add_epi32(a, b)
+    #define vi_mul(a,b)             _mm512_mullo_epi32(a, b)
+    #define vi_min(a,b)             _mm512_min_epi32(a, b)
+    #define vi_max(a,b)             _mm512_max_epi32(a, b)
+    #define vi_and(a,b)             _mm512_and_si512(a, b)
+    #define vi_slli(a,n)            _mm512_slli_epi32(a, n)
+    #define vi_srli(a,n)            _mm512_srli_epi32(a, n)
+    #define vi_srai(a,n)            _mm512_srai_epi32(a, n)
+    #define vf_from_int(a)          _mm512_cvtepi32_ps(a)
+    #define vi_gather(base,index)   _mm512_i32gather_epi32(index, base, 4)
+    #define vi_gather_bytes(base,offset) _mm512_i32gather_epi32(offset, base, 1)
+    #define vf_gather(base,offset)  _mm512_i32gather_ps(offset, base, 1)
+
+#elif TRANSFORM_LANES == 8
+
+    #define vf_t                    __m256
+    #define vi_t                    __m256i
+    #define vf_set1(a)              _mm256_set1_ps(a)
+    #define vf_fmadd(a,b,c)         _mm256_fmadd_ps(a, b, c)
+    #define vf_storeu(p,a)          _mm256_storeu_ps(p, a)
+    #define vi_set1(a)              _mm256_set1_epi32(a)
+    #define vi_lanes()              _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)
+    #define vi_add(a,b)             _mm256_add_epi32(a, b)
+    #define vi_mul(a,b)             _mm256_mullo_epi32(a, b)
+    #define vi_min(a,b)             _mm256_min_epi32(a, b)
+    #define vi_max(a,b)             _mm256_max_epi32(a, b)
+    #define vi_and(a,b)             _mm256_and_si256(a, b)
+    #define vi_or(a,b)              _mm256_or_si256(a, b)
+    #define vi_cmpeq(a,b)           _mm256_cmpeq_epi32(a, b)
+    #define vi_slli(a,n)            _mm256_slli_epi32(a, n)
+    #define vi_srli(a,n)            _mm256_srli_epi32(a, n)
+    #define vi_srai(a,n)            _mm256_srai_epi32(a, n)
+    #define vf_sub(a,b)             _mm256_sub_ps(a, b)
+    #define vf_from_int(a)          _mm256_cvtepi32_ps(a)
+    #define vf_as_int(a)            _mm256_castps_si256(a)
+    #define vi_as_float(a)          _mm256_castsi256_ps(a)
+    #define vi_gather(base,index)   _mm256_i32gather_epi32((int const *)(base), index, 4)
+    #define vi_gather_bytes(base,offset) _mm256_i32gather_epi32((int const *)(base), offset, 1)
+    #define vf_gather(base,offset)  _mm256_i32gather_ps((f32 const *)(base), offset, 1)
+
+#elif TRANSFORM_LANES == 4
+
+    #define vf_t                    __m128
+    #define vi_t                    __m128i
+    #define vf_set1(a)              _mm_set1_ps(a)
+    #define vf_fmadd(a,b,c)         _mm_add_ps(_mm_mul_ps(a, b), c)
+    #define vf_storeu(p,a)          _mm_storeu_ps(p, a)
+    #define vi_set1(a)              _mm_set1_epi32(a)
+    #define vi_lanes()              _mm_setr_epi32(0, 1, 2, 3)
+    #define vi_add(a,b)             _mm_add_epi32(a, b)
+    #define vi_mul(a,b)             _mm_mullo_epi32(a, b)
+    #define vi_min(a,b)             _mm_min_epi32(a, b)
+    #define vi_max(a,b)             _mm_max_epi32(a, b)
+    #define vi_and(a,b)             _mm_and_si128(a, b)
+    #define vi_or(a,b)              _mm_or_si128(a, b)
+    #define vi_cmpeq(a,b)           _mm_cmpeq_epi32(a, b)
+    #define vi_slli(a,n)            _mm_slli_epi32(a, n)
+    #define vi_srli(a,n)            _mm_srli_epi32(a, n)
+    #define vi_srai(a,n)            _mm_srai_epi32(a, n)
+    #define vf_sub(a,b)             _mm_sub_ps(a, b)
+    #define vf_from_int(a)          _mm_cvtepi32_ps(a)
+    #define vf_as_int(a)            _mm_castps_si128(a)
+    #define vi_as_float(a)          _mm_castsi128_ps(a)
+    // no gather before AVX2, the lanes are loaded one by one
+    #define vi_gather(base,index)   _mm_setr_epi32((i32)(base)[_mm_extract_epi32(index, 0)],\
+                                                   (i32)(base)[_mm_extract_epi32(index, 1)],\
+                                                   (i32)(base)[_mm_extract_epi32(index, 2)],\
+                                                   (i32)(base)[_mm_extract_epi32(index, 3)])
+    #define vf_gather(base,offset)  _mm_setr_ps(*(f32 const *)((char const *)(base) + _mm_extract_epi32(offset, 0)),\
+                                                *(f32 const *)((char const *)(base) + _mm_extract_epi32(offset, 1)),\
+                                                *(f32 const *)((char const *)(base) + _mm_extract_epi32(offset, 2)),\
+                                                *(f32 const *)((char const *)(base) + _mm_extract_epi32(offset, 3)))
+    #define vi_gather_bytes(base,offset) _mm_setr_epi32(*(i32 const *)((char const *)(base) + _mm_extract_epi32(offset, 0)),\
+                                                     *(i32 const *)((char const *)(base) + _mm_extract_epi32(offset, 1)),\
+                                                     *(i32 const *)((char const *)(base) + _mm_extract_epi32(offset, 2)),\
+                                                     *(i32 const *)((char const *)(base) + _mm_extract_epi32(offset, 3)))
+
+#else
+    #error "TRANSFORM_LANES must be 16, 8 or 4"
+#endif
+
+#if TRANSFORM_LANES == 16
+
+    #define TRANSFORM_HALF_TO_FLOAT(h)  _mm512_cvtph_ps(_mm512_cvtepi32_epi16(h))
+
+#else
+
+/*
+    Half floats in the low 16 bits of the lanes to floats. The exponent is
+    rebiased in place, denormals are normalized by subtracting the implicit
+    bit they were given and infinities and NaNs get the top exponent
+*/
+TRANSFORM_TARGET fn FORCE_INLINE vf_t TRANSFORM_HALF(vi_t h)
+{
+    vi_t const exponent = vi_and(h, vi_set1(0x7C00));
+    vi_t const denormal = vi_cmpeq(exponent, vi_set1(0));
+    vi_t const special  = vi_cmpeq(exponent, vi_set1(0x7C00));
+
+    vi_t bits = vi_add(vi_slli(vi_and(h, vi_set1(0x7FFF)), 13), vi_set1(112 << 23));
+    bits = vi_add(bits, vi_and(special,  vi_set1(112 << 23)));
+    bits = vi_add(bits, vi_and(denormal, vi_set1(1 << 23)));
+
+    vf_t const magnitude = vf_sub(vi_as_float(bits), vi_as_float(vi_and(denormal, vi_set1(113 << 23))));
+
+    return vi_as_float(vi_or(vf_as_int(magnitude), vi_slli(vi_and(h, vi_set1(0x8000)), 16)));
+}
+
+    #define TRANSFORM_HALF_TO_FLOAT(h)  TRANSFORM_HALF(h)
+
+#endif
+
+/*
+    x, y and z of the positions at byte offsets `offset` from base
+*/
+TRANSFORM_TARGET fn FORCE_INLINE void TRANSFORM_LOAD(char const *base, vi_t offset, attribute_format_t format, vf_t *x, vf_t *y, vf_t *z)
+{
+    switch (format)
+    {
+        case ATTRIBUTE_FORMAT_F16:
+        {
+            vi_t const xy = vi_gather_bytes(base + 0, offset);
+            vi_t const yz = vi_gather_bytes(base + 2, offset);
+
+            *x = TRANSFORM_HALF_TO_FLOAT(vi_and(xy, vi_set1(0xFFFF)));
+            *y = TRANSFORM_HALF_TO_FLOAT(vi_srli(xy, 16));
+            *z = TRANSFORM_HALF_TO_FLOAT(vi_srli(yz, 16));
+        } break;
+
+        case ATTRIBUTE_FORMAT_SNORM16:
+        {
+            vi_t const xy = vi_gather_bytes(base + 0, offset);
+            vi_t const yz = vi_gather_bytes(base + 2, offset);
+
+            // -32768 stands for -1 like -32767
+            vi_t const lowest = vi_set1(-32767);
+
+            *x = vf_from_int(vi_max(vi_srai(vi_slli(xy, 16), 16), lowest));
+            *y = vf_from_int(vi_max(vi_srai(xy, 16), lowest));
+            *z = vf_from_int(vi_max(vi_srai(yz, 16), lowest));
+        } break;
+
+        case ATTRIBUTE_FORMAT_UNORM8:
+        {
+            vi_t const xyz = vi_gather_bytes(base, offset);
+
+            *x = vf_from_int(vi_and(xyz, vi_set1(0xFF)));
+            *y = vf_from_int(vi_and(vi_srli(xyz, 8), vi_set1(0xFF)));
+            *z = vf_from_int(vi_and(vi_srli(xyz, 16), vi_set1(0xFF)));
+        } break;
+
+        case ATTRIBUTE_FORMAT_UNORM10_10_10_2:
+        {
+            vi_t const xyz = vi_gather_bytes(base, offset);
+
+            *x = vf_from_int(vi_and(xyz, vi_set1(0x3FF)));
+            *y = vf_from_int(vi_and(vi_srli(xyz, 10), vi_set1(0x3FF)));
+            *z = vf_from_int(vi_and(vi_srli(xyz, 20), vi_set1(0x3FF)));
+        } break;
+
+        default:
+        {
+            *x = vf_gather(base + 0, offset);
+            *y = vf_gather(base + 4, offset);
+            *z = vf_gather(base + 8, offset);
+        } break;
+    }
+}
+
+/*
+    Transform positions [first, first + count) as points by m into out, or the
+    positions indices[first + i] when indices are given. Lanes past the end
+    repeat the last position so every load stays inside the attribute and out
+    is written up to a whole number of lanes
+*/
+TRANSFORM_TARGET fn void TRANSFORM_NAME(mat4x4_t const *m, attribute_t positions, u32 const *indices, u32 first, u32 count, vertex_batch_t *out)
+{
+    char const *base = ATTR_AT(positions, indices ? 0 : first);
+
+    vf_t const m00 = vf_set1(m->values[ 0]), m01 = vf_set1(m->values[ 1]), m02 = vf_set1(m->values[ 2]), m03 = vf_set1(m->values[ 3]);
+    vf_t const m10 = vf_set1(m->values[ 4]), m11 = vf_set1(m->values[ 5]), m12 = vf_set1(m->values[ 6]), m13 = vf_set1(m->values[ 7]);
+    vf_t const m20 = vf_set1(m->values[ 8]), m21 = vf_set1(m->values[ 9]), m22 = vf_set1(m->values[10]), m23 = vf_set1(m->values[11]);
+    vf_t const m30 = vf_set1(m->values[12]), m31 = vf_set1(m->values[13]), m32 = vf_set1(m->values[14]), m33 = vf_set1(m->values[15]);
+
+    vi_t const stride = vi_set1((i32)positions.stride);
+    vi_t const last   = vi_set1((i32)count - 1);
+
+    for (u32 i = 0; i < count; i += TRANSFORM_LANES)
+    {
+        vi_t lane = vi_min(vi_add(vi_set1((i32)i), vi_lanes()), last);
+
+        if (indices) {
+            lane = vi_gather(indices + first, lane);
+        }
+
+        // byte offsets of the lanes from base
+        vi_t const offset = vi_mul(lane, stride);
+
+        vf_t x, y, z;
+        TRANSFORM_LOAD(base, offset, positions.format, &x, &y, &z);
+
+        vf_storeu(&out->x[i], vf_fmadd(m00, x, vf_fmadd(m01, y, vf_fmadd(m02, z, m03))));
+        vf_storeu(&out->y[i], vf_fmadd(m10, x, vf_fmadd(m11, y, vf_fmadd(m12, z, m13))));
+        vf_storeu(&out->z[i], vf_fmadd(m20, x, vf_fmadd(m21, y, vf_fmadd(m22, z, m23))));
+        vf_storeu(&out->w[i], vf_fmadd(m30, x, vf_fmadd(m31, y, vf_fmadd(m32, z, m33))));
+    }
+}
+
+#undef vf_t
+#undef vi_t
+#undef vf_set1
+#undef vf_fmadd
+#undef vf_storeu
+#undef vi_set1
+#undef vi_lanes
+#undef vi_add
+#undef vi_mul
+#undef vi_min
+#undef vf_gather
+#undef vi_gather
+#undef vi_gather_bytes
+#undef vi_max
+#undef vi_and
+#undef vi_or
+#undef vi_cmpeq
+#undef vi_slli
+#undef vi_srli
+#undef vi_srai
+#undef vf_sub
+#undef vf_from_int
+#undef vf_as_int
+#undef vi_as_float
+
+#undef TRANSFORM_CONCAT_
+#undef TRANSFORM_CONCAT
+#undef TRANSFORM_HALF
+#undef TRANSFORM_HALF_TO_FLOAT
+#undef TRANSFORM_LOAD
+
+#undef TRANSFORM_LANES
+#undef TRANSFORM_NAME
+#undef TRANSFORM_TARGET
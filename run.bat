@@ -6,7 +6,7 @@ copy ".\external\lib\*.dll"  ".\build\"
 :: set enviroment vars and requred stuff for the msvc compiler
 call "C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvarsall.bat" x64
 
-set CFLAGS=/Zi /EHsc /W4 /MD /nologo /utf-8 /std:clatest /arch:AVX
+set CFLAGS=/Zi /EHsc /W4 /MD /nologo /utf-8 /std:clatest /arch:AVX /openmp
 set SRC=..\Main.c ..\src\util.c
 set INCLUDE_DIRS=/I..\include
 set LIBRARY_DIRS=/LIBPATH:..\external\lib\VC
@@ -0,0 +1,224 @@
+/*
+    Meshlet cone culling has to drop exactly the meshlets the triangle culling
+    would have dropped anyway, whatever the depth mapping. A cube with finely
+    split faces, whose meshlets have narrow cones, is drawn with forward and
+    reversed depth, for both cull modes, once with its cones and once with
+    cones that never cull, and the two images must match.
+*/
+#define SDL_MAIN_HANDLED
+#define main renderer_main
+#include "../Main.c"
+#undef main
+
+#define TEST_WIDTH  320
+#define TEST_HEIGHT 240
+#define TEST_FRAMES 8
+
+typedef struct test_target_t
+{
+    image_view_t    color;
+    depth_view_t    depth;
+    hiz_t           hiz;
+    framebuffer_t   fb;
+    viewport_t      vp;
+}test_target_t;
+
+fn void test_target_init(test_target_t *t, bool reverse_z)
+{
+    *t = (test_target_t){0};
+
+    t->color.pixels = (color4_t *)CHECK_PTR(malloc(sizeof(color4_t) * TEST_WIDTH * TEST_HEIGHT));
+    t->color.width  = TEST_WIDTH;
+    t->color.height = TEST_HEIGHT;
+
+    t->depth.format    = DEPTH_FORMAT_D32F;
+    t->depth.reverse_z = reverse_z;
+    t->depth.hiz       = &t->hiz;
+    depth_view_resize(&t->depth, TEST_WIDTH, TEST_HEIGHT);
+
+    t->vp = (viewport_t){0, 0, TEST_WIDTH, TEST_HEIGHT};
+}
+
+/*
+    Cube of 6 faces split into grid x grid quads, wound counter-clockwise seen
+    from outside and built into meshlets the way loaded models are
+*/
+fn model_t *test_grid_cube(u32 grid)
+{
+    vec3f_t const normals[6]  = {{ 1, 0, 0}, {-1, 0, 0}, {0,  1, 0}, {0, -1, 0}, {0, 0,  1}, {0, 0, -1}};
+    vec3f_t const tangents[6] = {{ 0, 1, 0}, { 0, 0, 1}, {0,  0, 1}, {1,  0, 0}, {1, 0,  0}, {0, 1,  0}};
+    color4_t const colors[6]  = {{230, 60, 60, 255}, {60, 230, 60, 255}, {60, 60, 230, 255},
+                                 {230, 230, 60, 255}, {60, 230, 230, 255}, {230, 60, 230, 255}};
+
+    u32 const side = grid + 1;
+
+    model_t *model = (model_t *)CHECK_PTR(calloc(1, sizeof(model_t)));
+
+    model->vertex_count = 6 * side * side;
+    model->index_count  = 6 * grid * grid * 6;
+    model->positions    = (vec3f_t *)CHECK_PTR(malloc(sizeof(vec3f_t) * model->vertex_count));
+    model->colors       = (color4_t *)CHECK_PTR(malloc(sizeof(color4_t) * model->vertex_count));
+    model->indices      = (u32 *)CHECK_PTR(malloc(sizeof(u32) * model->index_count));
+
+    u32 *idx = model->indices;
+
+    for (u32 f = 0; f < 6; ++f)
+    {
+        vec3f_t const n = normals[f];
+        vec3f_t const u = tangents[f];
+        vec3f_t const v = vec3f_cross(&n, &u);
+
+        u32 const base = f * side * side;
+
+        for (u32 j = 0; j < side; ++j) {
+            for (u32 i = 0; i < side; ++i)
+            {
+                f32 const s = 2.f * (f32)i / (f32)grid - 1.f;
+                f32 const t = 2.f * (f32)j / (f32)grid - 1.f;
+
+                model->positions[base + j * side + i] = (vec3f_t){n.x + s * u.x + t * v.x,
+                                                                  n.y + s * u.y + t * v.y,
+                                                                  n.z + s * u.z + t * v.z};
+                model->colors[base + j * side + i] = colors[f];
+            }
+        }
+
+        for (u32 j = 0; j < grid; ++j) {
+            for (u32 i = 0; i < grid; ++i)
+            {
+                u32 const a = base + j * side + i;
+                u32 const b = a + 1;
+                u32 const c = a + side;
+                u32 const d = c + 1;
+
+                *idx++ = a; *idx++ = b; *idx++ = d;
+                *idx++ = a; *idx++ = d; *idx++ = c;
+            }
+        }
+    }
+
+    model_quantize(model);
+    model->bounds = bounds_from_positions(model->positions, model->vertex_count);
+    model_build_meshlets(model);
+
+    return model;
+}
+
+fn raster_stats_t test_render(test_target_t *t, model_t const *model, meshlet_t const *meshlets, cull_mode_t cull_mode, f32 time)
+{
+    clear_screen(&t->color, (color4_t){0, 0, 0, 255});
+    clear_depth(&t->depth);
+    raster_stats_reset(&binner);
+
+    t->fb = (framebuffer_t){.color = &t->color, .depth = &t->depth};
+
+    f32 const aspect = (f32)TEST_WIDTH / (f32)TEST_HEIGHT;
+
+    mat4x4_t const rotatezx    = mat_rotate_zx(time);
+    mat4x4_t const rotatexy    = mat_rotate_xy(time * 1.61f);
+    mat4x4_t const translate   = mat_translate((vec3f_t){0.f, 0.f, -5.f});
+    mat4x4_t const perspective = t->depth.reverse_z ?
+                                 mat_perspective_reverse_z(0.01f, 10.f, (f32)(M_PI / 3.f), aspect) :
+                                 mat_perspective(0.01f, 10.f, (f32)(M_PI / 3.f), aspect);
+
+    mat4x4_t transform = mat4x4_mult(&rotatezx, &rotatexy);
+    transform = mat4x4_mult(&transform, &translate);
+    transform = mat4x4_mult(&transform, &perspective);
+
+    draw_command_t const cmd = {
+        .mesh = {
+            .positions = {model->quantized_positions, sizeof(vec3i16_t), ATTRIBUTE_FORMAT_SNORM16},
+            .colors = ATTR_NEW(model->colors),
+            .indices = model->indices,
+            .count = model->index_count,
+            .vertex_count = model->vertex_count,
+            .bounds = &model->bounds,
+            .position_quantization = &model->quantization,
+            .meshlets = meshlets,
+            .meshlet_vertices = model->meshlet_vertices,
+            .meshlet_triangles = model->meshlet_triangles,
+            .meshlet_count = model->meshlet_count,
+            .meshlet_vertex_count = model->meshlet_vertex_count,
+        },
+        .pipeline = {
+            .cull_mode = cull_mode,
+            .depth = {
+                .test    = true,
+                .write   = true,
+                .compare = t->depth.reverse_z ? COMPARE_GREATER : COMPARE_LESS,
+            },
+            .interpolation = INTERPOLATION_PERSPECTIVE,
+            .attributes = ATTRIBUTE_COLOR,
+        },
+        .transform = transform,
+    };
+    draw_mesh(&t->fb, &cmd, &t->vp);
+
+    return raster_stats_total(&binner);
+}
+
+int main(void)
+{
+    raster_init();
+    binner_resize(&binner, TEST_WIDTH, TEST_HEIGHT);
+
+    model_t *model = test_grid_cube(16);
+
+    // same meshlets, with cones no eye can be inside of
+    meshlet_t *uncut = (meshlet_t *)CHECK_PTR(malloc(sizeof(meshlet_t) * model->meshlet_count));
+    for (u32 i = 0; i < model->meshlet_count; ++i) {
+        uncut[i] = model->meshlets[i];
+        uncut[i].cone_cutoff = 2.f;
+    }
+
+    color4_t *reference = (color4_t *)CHECK_PTR(malloc(sizeof(color4_t) * TEST_WIDTH * TEST_HEIGHT));
+
+    cull_mode_t const cull_modes[] = {CULL_MODE_CW, CULL_MODE_CCW};
+    char const *cull_names[]       = {"cw", "ccw"};
+
+    u32 failures = 0;
+
+    for (u32 reverse_z = 0; reverse_z < 2; ++reverse_z)
+    {
+        test_target_t t;
+        test_target_init(&t, reverse_z);
+
+        for (u32 c = 0; c < 2; ++c)
+        {
+            u64 cone_culled = 0;
+            u64 mismatched  = 0;
+
+            for (u32 frame = 0; frame < TEST_FRAMES; ++frame)
+            {
+                f32 const time = (f32)frame * 0.37f;
+
+                test_render(&t, model, uncut, cull_modes[c], time);
+                memcpy(reference, t.color.pixels, sizeof(color4_t) * TEST_WIDTH * TEST_HEIGHT);
+
+                raster_stats_t const stats = test_render(&t, model, model->meshlets, cull_modes[c], time);
+                cone_culled += stats.meshlets_cone_culled;
+
+                for (u32 i = 0; i < TEST_WIDTH * TEST_HEIGHT; ++i) {
+                    mismatched += memcmp(&reference[i], &t.color.pixels[i], sizeof(color4_t)) != 0;
+                }
+            }
+
+            // the cube is closed and seen from outside, clockwise culling has
+            // back facing meshlets for the cones to drop
+            bool const ok = mismatched == 0 && (cull_modes[c] != CULL_MODE_CW || cone_culled > 0);
+
+            printf("%s %s depth, %s culling: %llu meshlets cone culled, %llu pixels differ\n",
+                   ok ? "PASS" : "FAIL", reverse_z ? "reverse" : "forward", cull_names[c],
+                   (unsigned long long)cone_culled, (unsigned long long)mismatched);
+
+            failures += !ok;
+        }
+
+        free(t.color.pixels);
+    }
+
+    free(reference);
+    free(uncut);
+
+    return failures != 0;
+}